@@ -8,6 +8,16 @@ Fait tourner 4 moteurs brushless avec un ATMega328p sur PD1, PD2, PD3, PD4
 #include <avr/io.h> 
 #include <avr/interrupt.h>
 
+//PMW_SIMULTANEOUS=1 : les 4 sorties montent ensemble et chacune redescend a la fin de sa propre impulsion.
+//La trame dure max(servo[]) au lieu de la somme des 4 impulsions et chaque moteur a le meme retard.
+//PMW_SIMULTANEOUS=0 : PD1 a PD4 sont pulses l'un apres l'autre.
+#define PMW_SIMULTANEOUS 1
+
+//Deux fins d'impulsion plus proches que ca (en tops d'horloge) sont traitees dans la meme interruption
+#define PMW_MIN_GAP 16
+
+#define MOTORS_PINS (1<<PORTD1 | 1<<PORTD2 | 1<<PORTD3 | 1<<PORTD4)
+
 //Renvoie le nombre de tops d'horloge d'une durée donnée en microseconde
 //Il est important de bien renseigner les deux constantes
 //globales clockSourceMhz et prescaler.
@@ -22,16 +32,27 @@ const uint8_t prescaler = 8;
 volatile uint32_t timeFromStartMs = 0;
 
 volatile uint32_t servo[4] = {700, 700, 700, 700}; //Initial speed - 700 to 2000 for ESC Turnigy Plush
+#if PMW_SIMULTANEOUS == 1
+volatile int8_t channel = -1; //Prochaine fin d'impulsion (0 a 3, la plus courte d'abord), -1 en attente de la periode suivante
+#else
 volatile int8_t channel = 1; //Controlled motor number : 0, 1, 2 or 3
+#endif
+
+//Fins d'impulsion de la periode en cours, triees de la plus courte a la plus longue, et sorties correspondantes
+uint16_t pulseEnd[4];
+uint8_t pulsePin[4];
 
 int main(void){
 
 	TCCR1B |= 1<<CS11; //Prescaler 8 avec une horlge à 8Mhz
 	TIMSK1 |= (1<<OCIE1A); //Interrupt on OCR1A
-	OCR1A = servo[0]; //Set the first interrupt to occur when the first pulse was ended
-	
 	DDRD |= 1<<DDD1 | 1<<DDD2 | 1<<DDD3 | 1<<DDD4; //Ports set as OUTPUTS
+#if PMW_SIMULTANEOUS == 1
+	OCR1A = usToTicks(20000); //La premiere periode commence apres 20ms
+#else
+	OCR1A = servo[0]; //Set the first interrupt to occur when the first pulse was ended
 	PORTD = 1<<channel; //Set first servo pin high
+#endif
 	
 	sei(); //Enable global interrupts
 	
@@ -77,6 +98,52 @@ int main(void){
 	return 0;
 }
 
+#if PMW_SIMULTANEOUS == 1
+
+//PMW Building ISR
+ISR(TIMER1_COMPA_vect)
+{
+	if(channel < 0){ //Debut de periode, toutes les sorties montent
+		TCNT1 = 0;
+		PORTD |= MOTORS_PINS;
+		
+		//Tri des impulsions (tri par insertion, 4 valeurs)
+		for(uint8_t i = 0 ; i < 4 ; i++){
+			uint16_t value = usToTicks(servo[i]);
+			int8_t j = i - 1;
+			while((j >= 0) && (pulseEnd[j] > value)){
+				pulseEnd[j + 1] = pulseEnd[j];
+				pulsePin[j + 1] = pulsePin[j];
+				j--;
+			}
+			pulseEnd[j + 1] = value;
+			pulsePin[j + 1] = 1<<(i + 1);
+		}
+		
+		channel = 0;
+		OCR1A = pulseEnd[0];
+		timeFromStartMs += 20;
+	}
+	else{
+		//Descend toutes les sorties dont l'impulsion finit maintenant ou dans moins de PMW_MIN_GAP tops
+		while((channel < 4) && (TCNT1 + PMW_MIN_GAP >= pulseEnd[channel])){
+			while(TCNT1 < pulseEnd[channel]); //Attend la fin exacte
+			PORTD &= ~pulsePin[channel];
+			channel++;
+		}
+		
+		if(channel < 4){
+			OCR1A = pulseEnd[channel];
+		}
+		else{
+			OCR1A = usToTicks(20000);
+			channel = -1; //Wait for the next period
+		}
+	}
+}
+
+#else
+
 //PMW Building ISR
 ISR(TIMER1_COMPA_vect)
 {
@@ -109,6 +176,8 @@ ISR(TIMER1_COMPA_vect)
 	}
 }
 
+#endif
+
 //Renvoie le nombre de tops d'horloge d'une durée donnée en microseconde
 //Il est important de bien renseigner les deux constantes
 //globales clockSourceMhz et prescaler.
@@ -0,0 +1,16 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <avr/interrupt.h> for rx_test.c.
+//An ISR is a plain function, called by rx_test.c for each received byte.
+//*****************************************
+
+#ifndef HOST_AVR_INTERRUPT
+#define HOST_AVR_INTERRUPT
+
+#define ISR(vector) void vector(void)
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,45 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <avr/io.h> for rx_test.c : the USART registers used by
+//monni_rx.c are plain variables, written by rx_test.c before it calls USART_RX_vect.
+//*****************************************
+
+#ifndef HOST_AVR_IO
+#define HOST_AVR_IO
+
+#include <stdint.h>
+
+//USART 0
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UCSR0B;
+extern volatile uint8_t UCSR0C;
+extern volatile uint16_t UBRR0;
+extern volatile uint8_t UDR0;
+
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define MPCM0 0
+
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ02 2
+
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01 5
+#define UPM00 4
+#define USBS0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#define UCPOL0 0
+
+#endif
@@ -0,0 +1,289 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host test of the serial receiver decoder (monni_rx.c). A byte stream is sent
+//to USART_RX_vect at the line speed of the protocol, rxParse() runs at each
+//main loop pass (every -l microseconds, as the RC Control main loop).
+//Stream file : one line per burst of bytes sent back to back, its start time in
+//microseconds then the bytes in hexadecimal. Lines starting with # are comments,
+//except "#expect frames N errors M" : the run fails if the counts differ.
+//
+//Usage : rx_test [-l loopUs] sbus|ibus file
+//        rx_test [-t seconds] -w sbus|ibus file
+//-w writes -t seconds of a receiver stream (synthetic sticks) and stops.
+//Prints the counts and the frames per second, returns 1 if they are not the expected ones.
+//*****************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "monni_rx.h"
+
+//USART registers of avr/io.h
+volatile uint8_t UCSR0A;
+volatile uint8_t UCSR0B;
+volatile uint8_t UCSR0C;
+volatile uint16_t UBRR0;
+volatile uint8_t UDR0;
+
+void USART_RX_vect(void);
+
+#define SBUS_BYTE_US 120.0 //100000 bauds, 12 bits (start, 8 data, parity, 2 stop)
+#define IBUS_BYTE_US 86.8 //115200 bauds, 10 bits (start, 8 data, stop)
+
+#define SBUS_FRAME_US 14000 //Receivers stream period (SBUS normal speed, IBUS)
+#define IBUS_FRAME_US 7000
+
+//Received bytes, with the time their stop bit ends
+typedef struct {
+	double us;
+	uint8_t data;
+} RxByte;
+
+RxByte *rxBytes = NULL;
+uint32_t rxNbBytes = 0;
+
+//"#expect" line of the stream, -1 if none
+long expectFrames = -1;
+long expectErrors = -1;
+
+//Read a stream file, return 0 on error
+uint8_t loadStream(const char *fileName, double byteUs){
+	FILE *file = fopen(fileName, "r");
+	if(file == NULL){
+		perror(fileName);
+		return 0;
+	}
+
+	char line[1024];
+	uint32_t size = 0;
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		if(line[0] == '#'){
+			sscanf(line, "#expect frames %ld errors %ld", &expectFrames, &expectErrors);
+			continue;
+		}
+
+		char *next = line;
+		char *end;
+		double startUs = strtod(next, &end);
+		if(end == next){
+			continue; //Empty line
+		}
+		next = end;
+
+		for(uint32_t i = 0 ; ; i++){
+			long data = strtol(next, &end, 16);
+			if(end == next){
+				break;
+			}
+			next = end;
+			if(rxNbBytes == size){
+				size = size ? 2 * size : 4096;
+				rxBytes = realloc(rxBytes, size * sizeof(RxByte));
+			}
+			rxBytes[rxNbBytes].us = startUs + (i + 1) * byteUs;
+			rxBytes[rxNbBytes].data = data;
+			rxNbBytes++;
+		}
+	}
+	fclose(file);
+
+	if(rxNbBytes == 0){
+		fprintf(stderr, "%s: no byte\n", fileName);
+		return 0;
+	}
+	return 1;
+}
+
+//Sticks of the synthetic streams, 1000 to 2000us
+uint16_t stickUs(uint8_t channel, double t){
+	return 1500 + 500 * sin(2.0 * M_PI * (0.3 + 0.2 * channel) * t);
+}
+
+void writeBurst(FILE *file, double us, uint8_t *bytes, uint8_t nbBytes){
+	fprintf(file, "%.0f", us);
+	for(uint8_t i = 0 ; i < nbBytes ; i++){
+		fprintf(file, " %02X", bytes[i]);
+	}
+	fprintf(file, "\n");
+}
+
+//SBUS stream: the tail of a frame first (listening starts while the receiver sends),
+//then one frame per SBUS_FRAME_US. One bad end byte, one SBUS2 end byte, failsafe at the end.
+void writeSbus(FILE *file, double duration){
+	uint32_t nbFrames = duration * 1e6 / SBUS_FRAME_US;
+	uint8_t tail[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}; //Channels 15 and 16 at 0, flags, end
+
+	fprintf(file, "#SBUS stream written by rx_test -w, %u frames every %uus\n", nbFrames, SBUS_FRAME_US);
+	fprintf(file, "#expect frames %u errors 1\n", nbFrames - 1);
+	writeBurst(file, 0, tail, sizeof(tail));
+
+	for(uint32_t n = 0 ; n < nbFrames ; n++){
+		double us = 3000 + n * SBUS_FRAME_US;
+		uint8_t frame[25];
+		memset(frame, 0, sizeof(frame));
+		frame[0] = 0x0F;
+
+		//16 channels of 11 bits, LSB first: 988 to 2012us => 172 to 1811
+		uint32_t bitIndex = 8;
+		for(uint8_t i = 0 ; i < 16 ; i++){
+			uint16_t value = (stickUs(i, us * 1e-6) - 880) * 8 / 5;
+			for(uint8_t bit = 0 ; bit < 11 ; bit++, bitIndex++){
+				if(value & (1<<bit)){
+					frame[bitIndex >> 3] |= 1<<(bitIndex & 0x07);
+				}
+			}
+		}
+
+		if(n + 5 >= nbFrames){
+			frame[23] = 1<<2 | 1<<3; //Frame lost and failsafe
+		}
+		if(n == nbFrames / 3){
+			frame[24] = 0xFF; //Bad end byte
+		}
+		else if(n == nbFrames / 2){
+			frame[24] = 0x14; //SBUS2 end byte
+		}
+		writeBurst(file, us, frame, sizeof(frame));
+	}
+}
+
+//IBUS stream: garbage first (a lone header byte), then one frame per IBUS_FRAME_US, one bad checksum.
+void writeIbus(FILE *file, double duration){
+	uint32_t nbFrames = duration * 1e6 / IBUS_FRAME_US;
+	uint8_t garbage[] = {0x20, 0x20, 0x55, 0xDC, 0x05};
+
+	fprintf(file, "#IBUS stream written by rx_test -w, %u frames every %uus\n", nbFrames, IBUS_FRAME_US);
+	fprintf(file, "#expect frames %u errors 1\n", nbFrames - 1);
+	writeBurst(file, 0, garbage, sizeof(garbage));
+
+	for(uint32_t n = 0 ; n < nbFrames ; n++){
+		double us = 2000 + n * IBUS_FRAME_US;
+		uint8_t frame[32];
+		frame[0] = 0x20;
+		frame[1] = 0x40;
+
+		for(uint8_t i = 0 ; i < 14 ; i++){
+			uint16_t value = stickUs(i, us * 1e-6);
+			frame[2 + 2*i] = value & 0xFF;
+			frame[3 + 2*i] = value >> 8;
+		}
+
+		uint16_t checksum = 0xFFFF;
+		for(uint8_t i = 0 ; i < 30 ; i++){
+			checksum -= frame[i];
+		}
+		if(n == nbFrames / 3){
+			checksum ^= 0x0100; //Bad checksum
+		}
+		frame[30] = checksum & 0xFF;
+		frame[31] = checksum >> 8;
+		writeBurst(file, us, frame, sizeof(frame));
+	}
+}
+
+int main(int argc, char *argv[]){
+
+	double duration = 2;
+	uint32_t loopUs = 1000;
+	uint8_t write = 0;
+	int i = 1;
+
+	for( ; (i < argc) && (argv[i][0] == '-') ; i++){
+		if(!strcmp(argv[i], "-w")){
+			write = 1;
+		}
+		else if(!strcmp(argv[i], "-t") && (i + 1 < argc)){
+			duration = atof(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-l") && (i + 1 < argc)){
+			loopUs = atoi(argv[++i]);
+		}
+		else{
+			break;
+		}
+	}
+
+	uint8_t protocol;
+	if((i + 2 == argc) && !strcmp(argv[i], "sbus")){
+		protocol = RX_SBUS;
+	}
+	else if((i + 2 == argc) && !strcmp(argv[i], "ibus")){
+		protocol = RX_IBUS;
+	}
+	else{
+		fprintf(stderr, "Usage: %s [-l loopUs] sbus|ibus file\n       %s [-t seconds] -w sbus|ibus file\n", argv[0], argv[0]);
+		return 1;
+	}
+	const char *fileName = argv[i + 1];
+
+	if(write){
+		FILE *file = fopen(fileName, "w");
+		if(file == NULL){
+			perror(fileName);
+			return 1;
+		}
+		if(protocol == RX_SBUS){
+			writeSbus(file, duration);
+		}
+		else{
+			writeIbus(file, duration);
+		}
+		fclose(file);
+		return 0;
+	}
+
+	if(!loadStream(fileName, (protocol == RX_SBUS) ? SBUS_BYTE_US : IBUS_BYTE_US)){
+		return 1;
+	}
+
+	rxInit(protocol);
+
+	//Main loop passes: the bytes received since the last pass, then rxParse()
+	uint32_t next = 0;
+	uint32_t passes = 0;
+	uint32_t newFramePasses = 0;
+	double firstFrameUs = -1;
+	double lastFrameUs = 0;
+
+	for(double us = 0 ; next < rxNbBytes ; us += loopUs){
+		while((next < rxNbBytes) && (rxBytes[next].us <= us)){
+			UDR0 = rxBytes[next].data;
+			UCSR0A = 1<<RXC0;
+			USART_RX_vect();
+			next++;
+		}
+
+		passes++;
+		if(rxParse()){
+			newFramePasses++;
+			if(firstFrameUs < 0){
+				firstFrameUs = us;
+			}
+			lastFrameUs = us;
+		}
+	}
+	rxParse(); //Bytes of the last pass
+
+	double seconds = (rxBytes[rxNbBytes - 1].us - rxBytes[0].us) * 1e-6;
+	printf("%s stream: %u bytes in %.3fs, rxParse() every %uus\n", (protocol == RX_SBUS) ? "SBUS" : "IBUS", rxNbBytes, seconds, loopUs);
+	printf("Frames %u, frame errors %u, byte errors %u\n", rxFrameCount, rxFrameErrors, rxByteErrors);
+	printf("%.1f frames per second, %u passes out of %u with a new frame", rxFrameCount / seconds, newFramePasses, passes);
+	if(newFramePasses > 1){
+		printf(" (%.1f per second)", (newFramePasses - 1) / ((lastFrameUs - firstFrameUs) * 1e-6));
+	}
+	printf("\nLast frame:");
+	for(uint8_t c = 0 ; c < ((protocol == RX_SBUS) ? 16 : 14) ; c++){
+		printf(" %u", rxChannels[c]);
+	}
+	printf("%s\n", rxFailsafe ? " (failsafe)" : "");
+
+	if(((expectFrames >= 0) && (rxFrameCount != expectFrames)) || ((expectErrors >= 0) && (rxFrameErrors != expectErrors)) || (rxByteErrors > 0)){
+		printf("FAILED: %ld frames and %ld frame errors expected, no byte error\n", expectFrames, expectErrors);
+		return 1;
+	}
+	return 0;
+}
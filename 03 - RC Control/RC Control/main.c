@@ -42,17 +42,71 @@ volatile uint16_t servo[4] = {2300, 2300, 2300, 2300}; //Initial speed in micros
 volatile int8_t channel = 1; //Controlled motor number : 1, 2, 3 or 4
 volatile uint16_t startPmwTcnt1 = 0; //TCNT1 value when the PMW cycle starts
 
-volatile uint16_t previousRcValue = 0;
+//RC receiver input
+#define RC_INPUT_PCINT 0 //One PWM signal per channel on PB1 to PB4 (pin change interrupts)
+#define RC_INPUT_PPM 1 //PPM sum signal on PB0 (ICP1, Timer 1 input capture)
+#define RC_INPUT_SERIAL 2 //SBUS or IBUS receiver on PD0 (USART, see monni_rx.h)
+#ifndef RC_INPUT //Can be given to the compiler (-DRC_INPUT=RC_INPUT_PPM, "make bench-ppm")
+#define RC_INPUT RC_INPUT_PCINT
+#endif
+
+#if RC_INPUT == RC_INPUT_PCINT
+
+//RC receiver channels on PB1 (yaw), PB2 (roll), PB3 (throttle) and PB4 (pitch), all measured every frame
+#define RC_PINS (1<<PCINT1 | 1<<PCINT2 | 1<<PCINT3 | 1<<PCINT4)
+
+//TCNT1 value at the last rising edge of each channel
+volatile uint16_t rcRiseTcnt1[4] = {0};
 
 //For interrupts PCINT
 volatile uint8_t portHistory = 0;
 
+#elif RC_INPUT == RC_INPUT_PPM
+
+#define PPM_MAX_CHANNELS 12
+#define PPM_MIN_CHANNELS 4 //Shorter frames are dropped
+#define PPM_SYNC_MIN_US 3000 //A longer interval between two rising edges starts a new frame
+
+//Channels order in the PPM frame (depends on the transmitter)
+#define PPM_ROLL 0
+#define PPM_PITCH 1
+#define PPM_THROTTLE 2
+#define PPM_YAW 3
+
+//Double buffered frames: ICP1 ISR fills ppmFrames[ppmWriteBuffer], the main loop reads the other one
+volatile uint16_t ppmFrames[2][PPM_MAX_CHANNELS];
+volatile uint8_t ppmWriteBuffer = 0;
+volatile uint8_t ppmChannelsCount = 0; //Channels in the last complete frame
+volatile uint8_t ppmNewFrame = 0; //Set by the ISR, cleared by the main loop
+
+volatile uint8_t ppmChannel = PPM_MAX_CHANNELS + 1; //Channel being received, invalid (frame dropped) until the first sync
+volatile uint16_t ppmLastCapture = 0; //ICR1 at the last rising edge
+
+#elif RC_INPUT == RC_INPUT_SERIAL
+
+#include "monni_rx.h"
+
+#define RX_PROTOCOL RX_SBUS //RX_SBUS or RX_IBUS
+
+//Channels order in the serial frame (depends on the transmitter)
+#define RX_ROLL 0
+#define RX_PITCH 1
+#define RX_THROTTLE 2
+#define RX_YAW 3
+
+#endif
+
 //RC commands
 volatile int16_t throttleUs = 0; //Altitude control
 volatile int16_t rollUs = 0; //Left or right
 volatile int16_t pitchUs = 0; //Up and down
 volatile int16_t yawUs = 0; //Left or right in level fly
 
+#if RC_INPUT == RC_INPUT_PCINT
+//RC commands in the PB1 to PB4 order
+volatile int16_t *const rcUs[4] = {&yawUs, &rollUs, &throttleUs, &pitchUs};
+#endif
+
 //Initial values of RC commands
 typedef volatile struct {
 	uint16_t initUs;
@@ -66,10 +120,14 @@ CenterRc centers[4] = {0};
 //A value of -1 means initialisation completed.
 volatile int8_t initStep = 0;
 
-volatile uint8_t pcintNb = 1;
-
 volatile uint16_t countDebug = 0;
 
+void rcSetCommands(uint16_t frame[4]);
+
+#if RC_INPUT == RC_INPUT_PPM
+void ppmReadFrame();
+#endif
+
 int main(void){
 	
 	TCCR1B |= 1<<CS11; //Prescaler of 8 because 8MHz clock source
@@ -97,9 +155,29 @@ int main(void){
 		
 		if((timeFromStartMs > 7000) && (initStep == 0)){
 			initStep = 1;
+#if RC_INPUT == RC_INPUT_PPM
+			TCCR1B |= 1<<ICNC1 | 1<<ICES1; //Noise canceler, capture on rising edges
+			TIFR1 = 1<<ICF1; //Clear a capture made before
+			TIMSK1 |= 1<<ICIE1; //Interrupt on input capture
+#elif RC_INPUT == RC_INPUT_SERIAL
+			rxInit(RX_PROTOCOL); //PD0 becomes the USART input
+#else
+			portHistory = PINB;
 			PCICR |= 1<<PCIE0; //Enable interrupt of PCINT7:0
-			PCMSK0 |= 1<<PCINT1;
+			PCMSK0 |= RC_PINS; //Every channel at once
+#endif
+		}
+		
+#if RC_INPUT == RC_INPUT_PPM
+		if(ppmNewFrame){
+			ppmReadFrame();
+		}
+#elif RC_INPUT == RC_INPUT_SERIAL
+		if(rxParse() && !rxFailsafe){
+			uint16_t frame[4] = {rxChannels[RX_YAW], rxChannels[RX_ROLL], rxChannels[RX_THROTTLE], rxChannels[RX_PITCH]};
+			rcSetCommands(frame);
 		}
+#endif
 		
 		if(initStep == -1){
 		
@@ -158,9 +236,30 @@ ISR(TIMER1_COMPA_vect)
 	}
 }
 
+//Initialisation process: average the first pulses of a channel to find its center
+void rcCenterUpdate(uint8_t rcChannel, uint16_t pulseUs){
+	if((centers[rcChannel].initCounter < 60000) && (centers[rcChannel].initUs < 40000)){
+		centers[rcChannel].initCounter++;
+		centers[rcChannel].initUs += pulseUs;
+	}
+	else if(centers[rcChannel].initCalculated == 0){
+		centers[rcChannel].initUs /= (float)centers[rcChannel].initCounter;
+		centers[rcChannel].initCalculated = 1;
+		if((centers[0].initCalculated == 1)
+			&& (centers[1].initCalculated == 1)
+			&& (centers[2].initCalculated == 1)
+			&& (centers[3].initCalculated == 1)){
+				initStep = -1;
+		}
+	}
+}
+
+#if RC_INPUT == RC_INPUT_PCINT
+
 ISR(PCINT0_vect){
 
 	uint16_t timerValue = TCNT1;
+	uint8_t pinState = PINB;
 	
 	uint8_t changedBits;
 
@@ -171,71 +270,100 @@ ISR(PCINT0_vect){
 	//XOR 0000001
 	//----------
 	//    0001000
-	changedBits = PINB ^ portHistory;
-	portHistory = PINB;
+	changedBits = (pinState ^ portHistory) & RC_PINS;
+	portHistory = pinState;
 	
-	if( (changedBits & (1<<pcintNb)) ){
-		//Min just goes high, is now high
-		if(portHistory & 1<<pcintNb){
-			previousRcValue = timerValue;
-		}
-		//Min just goes low, is now low
-		else{
-			int16_t temp;
-			if(timerValue > previousRcValue){
-				temp = (timerValue - previousRcValue);
+	//Several channels can change at once (end of a channel = start of the next one on most receivers)
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		uint8_t pinMask = 1<<(i + 1);
+		
+		if(changedBits & pinMask){
+			//Pin just goes high, is now high
+			if(pinState & pinMask){
+				rcRiseTcnt1[i] = timerValue;
 			}
+			//Pin just goes low, is now low
 			else{
-				temp = (65536 - previousRcValue) + timerValue;
-			}
-			
-			//Valid signal detected
-			if((temp >= (rcMinUs - 400)) && (temp <= (rcMaxUs + 400))){
-				switch(pcintNb){
-					case 1:	yawUs = temp;
-							break;
-					case 2:	rollUs = temp;
-							break;
-					case 3:	throttleUs = temp;
-							break;
-					case 4:	pitchUs = temp;
-							break;
-					default: break;
-				}
+				uint16_t temp = timerValue - rcRiseTcnt1[i]; //Unsigned difference, right even if TCNT1 overflowed
 				
-				//Initialisation process
-				if(initStep == 1){
-					if((centers[pcintNb - 1].initCounter < 60000) && (centers[pcintNb - 1].initUs < 40000)){
-						centers[pcintNb - 1].initCounter++;
-						centers[pcintNb - 1].initUs += temp;
-					}
-					else if(centers[pcintNb - 1].initCalculated == 0){
-						centers[pcintNb - 1].initUs /= (float)centers[pcintNb - 1].initCounter;
-						centers[pcintNb - 1].initCalculated = 1;
-						if((centers[0].initCalculated == 1)
-							&& (centers[1].initCalculated == 1)
-							&& (centers[2].initCalculated == 1)
-							&& (centers[3].initCalculated == 1)){
-								initStep = -1;
-						}
+				//Valid signal detected
+				if((temp >= (rcMinUs - 400)) && (temp <= (rcMaxUs + 400))){
+					*rcUs[i] = temp;
+					
+					if(initStep == 1){
+						rcCenterUpdate(i, temp);
 					}
 				}
-				
-				if(pcintNb == 4){
-					pcintNb = 1;
-				}
-				else{
-					pcintNb++;
-				}
-				
-				PCMSK0 &= ~(1<<(pcintNb - 1)); //Clear actual interrupt on PCINT
-				PCMSK0 |= 1<<pcintNb; //Enable newt interrupt on PCINT
-				
 			}
 		}
 	}
 }
 
+#elif RC_INPUT == RC_INPUT_PPM
+
+//PPM capture ISR. ICR1 holds TCNT1 latched by the hardware at the rising edge,
+//so the pulse widths do not depend on the interrupt latency.
+ISR(TIMER1_CAPT_vect){
+
+	uint16_t captured = ICR1;
+	uint16_t width = captured - ppmLastCapture; //Unsigned difference, right even if TCNT1 overflowed
+	ppmLastCapture = captured;
+	
+	if(width >= PPM_SYNC_MIN_US){ //Sync gap: the frame is over
+		if((ppmChannel >= PPM_MIN_CHANNELS) && (ppmChannel <= PPM_MAX_CHANNELS)){
+			ppmChannelsCount = ppmChannel;
+			ppmWriteBuffer ^= 1; //Publish
+			ppmNewFrame = 1;
+		}
+		ppmChannel = 0;
+	}
+	else if(ppmChannel < PPM_MAX_CHANNELS){
+		if((width >= (rcMinUs - 700)) && (width <= (rcMaxUs + 400))){
+			ppmFrames[ppmWriteBuffer][ppmChannel] = width;
+			ppmChannel++;
+		}
+		else{
+			ppmChannel = PPM_MAX_CHANNELS + 1; //Bad pulse, drop the frame until the next sync
+		}
+	}
+	else{
+		ppmChannel = PPM_MAX_CHANNELS + 1; //Too many channels, drop the frame
+	}
+}
+
+//Copy the last complete PPM frame to the RC commands
+void ppmReadFrame(){
+
+	uint16_t frame[4];
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		volatile uint16_t *readBuffer = ppmFrames[ppmWriteBuffer ^ 1];
+		frame[0] = readBuffer[PPM_YAW];
+		frame[1] = readBuffer[PPM_ROLL];
+		frame[2] = readBuffer[PPM_THROTTLE];
+		frame[3] = readBuffer[PPM_PITCH];
+		ppmNewFrame = 0;
+	}
+	
+	rcSetCommands(frame);
+}
+
+#endif
+
+//Set the RC commands from a complete frame (yaw, roll, throttle, pitch) decoded in the main loop
+void rcSetCommands(uint16_t frame[4]){
+	yawUs = frame[0];
+	rollUs = frame[1];
+	throttleUs = frame[2];
+	pitchUs = frame[3];
+	
+	if(initStep == 1){
+		for(uint8_t i = 0 ; i < 4 ; i++){
+			rcCenterUpdate(i, frame[i]);
+		}
+	}
+}
+
 //Renvoie le nombre de tops d'horloge d'une durée donnée en microseconde
 //Il est important de bien renseigner les deux constantes
 //globales clockSourceMhz et prescaler.
@@ -0,0 +1,158 @@
+#include <avr/interrupt.h>
+
+#include "monni_rx.h"
+
+#define SBUS_FRAME_SIZE 25
+#define SBUS_HEADER 0x0F
+
+#define IBUS_FRAME_SIZE 32
+#define IBUS_HEADER_0 0x20
+#define IBUS_HEADER_1 0x40
+#define IBUS_CHANNELS 14
+
+uint16_t rxChannels[RX_MAX_CHANNELS];
+uint8_t rxFrameLost = 0;
+uint8_t rxFailsafe = 0;
+
+uint16_t rxFrameCount = 0;
+uint16_t rxFrameErrors = 0;
+volatile uint16_t rxByteErrors = 0;
+
+//Ring buffer, written by USART_RX_vect only, read by rxParse() only
+volatile uint8_t rxBuffer[RX_BUFFER_SIZE];
+volatile uint8_t rxHead = 0; //Next byte to write
+volatile uint8_t rxTail = 0; //Next byte to read
+
+//Frame being rebuilt by rxParse()
+uint8_t rxProtocol = RX_SBUS;
+uint8_t rxFrame[IBUS_FRAME_SIZE];
+uint8_t rxFrameIndex = 0;
+
+//Store every received byte, nothing else
+ISR(USART_RX_vect){
+
+	uint8_t status = UCSR0A;
+	uint8_t data = UDR0;
+	uint8_t nextHead = (rxHead + 1) & (RX_BUFFER_SIZE - 1);
+
+	if((status & (1<<FE0 | 1<<DOR0 | 1<<UPE0)) || (nextHead == rxTail)){
+		rxByteErrors++;
+	}
+	else{
+		rxBuffer[rxHead] = data;
+		rxHead = nextHead;
+	}
+}
+
+//Configure the USART for the protocol and enable the receive interrupt
+void rxInit(uint8_t protocol){
+
+	rxProtocol = protocol;
+	rxFrameIndex = 0;
+
+	if(protocol == RX_SBUS){
+		UCSR0A = 0;
+		UBRR0 = 4; //8MHz / (16 * 100000) - 1, exact
+		UCSR0C = 1<<UPM01 | 1<<USBS0 | 1<<UCSZ01 | 1<<UCSZ00; //8 bits, even parity, 2 stop bits
+	}
+	else{
+		UCSR0A = 1<<U2X0;
+		UBRR0 = 8; //8MHz / (8 * 115200) - 1 = 7.7 => 111111 bauds, -3.5%
+		UCSR0C = 1<<UCSZ01 | 1<<UCSZ00; //8 bits, no parity, 1 stop bit
+	}
+
+	UCSR0B = 1<<RXCIE0 | 1<<RXEN0; //Receive only, with interrupt
+}
+
+//16 channels of 11 bits, LSB first, from byte 1 to 22
+void rxDecodeSbus(){
+
+	uint8_t byteIndex = 1;
+	uint8_t bitIndex = 0;
+
+	for(uint8_t i = 0 ; i < RX_MAX_CHANNELS ; i++){
+		uint32_t bits = rxFrame[byteIndex] | ((uint16_t)rxFrame[byteIndex + 1] << 8) | ((uint32_t)rxFrame[byteIndex + 2] << 16);
+		uint16_t value = (bits >> bitIndex) & 0x07FF;
+
+		//172 to 1811 => 988 to 2012us
+		rxChannels[i] = ((value * 5) >> 3) + 880;
+
+		bitIndex += 11;
+		byteIndex += bitIndex >> 3;
+		bitIndex &= 0x07;
+	}
+
+	rxFrameLost = (rxFrame[23] >> 2) & 1;
+	rxFailsafe = (rxFrame[23] >> 3) & 1;
+}
+
+//14 channels of 16 bits (little endian, already in us) from byte 2, checksum in the last 2 bytes
+uint8_t rxDecodeIbus(){
+
+	uint16_t checksum = 0xFFFF;
+
+	for(uint8_t i = 0 ; i < IBUS_FRAME_SIZE - 2 ; i++){
+		checksum -= rxFrame[i];
+	}
+
+	if(checksum != (rxFrame[30] | ((uint16_t)rxFrame[31] << 8))){
+		return 0;
+	}
+
+	for(uint8_t i = 0 ; i < IBUS_CHANNELS ; i++){
+		rxChannels[i] = rxFrame[2 + 2*i] | ((uint16_t)(rxFrame[3 + 2*i] & 0x0F) << 8);
+	}
+
+	return 1;
+}
+
+//Decode the bytes received since the last call.
+//Return 1 if at least one complete and valid frame was decoded in rxChannels[].
+uint8_t rxParse(){
+
+	uint8_t newFrame = 0;
+
+	while(rxTail != rxHead){
+		uint8_t data = rxBuffer[rxTail];
+		rxTail = (rxTail + 1) & (RX_BUFFER_SIZE - 1);
+
+		//Synchronisation on the header bytes
+		if(rxFrameIndex == 0){
+			if(data != ((rxProtocol == RX_SBUS) ? SBUS_HEADER : IBUS_HEADER_0)){
+				continue;
+			}
+		}
+		else if((rxFrameIndex == 1) && (rxProtocol == RX_IBUS) && (data != IBUS_HEADER_1)){
+			//Not a frame start, but this byte may be one
+			rxFrameIndex = (data == IBUS_HEADER_0) ? 1 : 0;
+			continue;
+		}
+
+		rxFrame[rxFrameIndex++] = data;
+
+		if((rxProtocol == RX_SBUS) && (rxFrameIndex == SBUS_FRAME_SIZE)){
+			rxFrameIndex = 0;
+			//End byte is 0x00 for SBUS, 0x04, 0x14, 0x24 or 0x34 for SBUS2
+			if((data == 0x00) || ((data & 0x0F) == 0x04)){
+				rxDecodeSbus();
+				rxFrameCount++;
+				newFrame = 1;
+			}
+			else{
+				rxFrameErrors++;
+			}
+		}
+		else if((rxProtocol == RX_IBUS) && (rxFrameIndex == IBUS_FRAME_SIZE)){
+			rxFrameIndex = 0;
+			if(rxDecodeIbus()){
+				rxFrameCount++;
+				newFrame = 1;
+			}
+			else{
+				rxFrameErrors++;
+			}
+		}
+	}
+
+	return newFrame;
+}
@@ -0,0 +1,44 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Serial RC receivers (SBUS / IBUS) on the ATmega328p USART (RXD = PD0).
+//USART_RX_vect only stores the bytes in a ring buffer, frames are decoded
+//by rxParse() from the main loop.
+//SBUS is an inverted signal: the ATmega328p USART can not invert it, put a
+//transistor inverter between the receiver and PD0.
+//*****************************************
+
+#ifndef MONNI_RX
+#define MONNI_RX
+
+#include <avr/io.h>
+
+//Protocols
+#define RX_SBUS 0 //100000 bauds, 8E2, 25 bytes frames, 16 channels of 11 bits
+#define RX_IBUS 1 //115200 bauds, 8N1, 32 bytes frames, 14 channels of 16 bits
+
+#define RX_MAX_CHANNELS 16
+
+//Ring buffer size, must be a power of 2
+#define RX_BUFFER_SIZE 64
+
+//Last decoded channels, in microseconds (1000 to 2000)
+extern uint16_t rxChannels[RX_MAX_CHANNELS];
+
+//SBUS flags of the last frame (always 0 for IBUS)
+extern uint8_t rxFrameLost;
+extern uint8_t rxFailsafe;
+
+//Statistics
+extern uint16_t rxFrameCount; //Valid frames
+extern uint16_t rxFrameErrors; //Bad end byte or checksum
+extern volatile uint16_t rxByteErrors; //Framing, parity or overrun errors, and ring buffer overflows
+
+//Configure the USART for the protocol and enable the receive interrupt
+void rxInit(uint8_t protocol);
+
+//Decode the bytes received since the last call.
+//Return 1 if at least one complete and valid frame was decoded in rxChannels[].
+uint8_t rxParse();
+
+#endif
@@ -0,0 +1,183 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Runs the AHRS (monni_ahrs.h), the TWI driver, the clock and the scheduler
+//on a Linux host, against the L3G4200D and LSM303D register models
+//(host_sensors.c) on a simulated ATmega328p (host_avr.c).
+//The motion is synthetic or replayed from a text file (host_motion.h).
+//
+//Usage : ahrs_sim [-t seconds] [-r file] [-w file] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]
+//-w writes -t seconds of the synthetic motion (1ms samples) to a replay file and stops.
+//Prints the estimated and true angles every -p ms (0 : none) on stdout,
+//the errors and TWI statistics on stderr.
+//Returns 1 if a TWI transaction failed while no fault was injected.
+//*****************************************
+
+#define F_CPU 8000000UL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "monni_hal.h"
+#include "monni_i2c.h"
+#include "monni_clock.h"
+#include "monni_scheduler.h"
+
+volatile uint16_t servo[4] = {700, 700, 700, 700}; //Written by Ahrs_calculations()
+
+#include "monni_ahrs.h"
+
+#include "host_sensors.h"
+#include "host_motion.h"
+
+//Same rates as main.c
+#define AHRS_HZ 50
+#define COMPASS_HZ 10
+
+#define SIM_ERROR_US 10000 //Errors sampled every 10ms
+#define SIM_SETTLE_US 3000000 //Errors counted after 3s (offsets and first DCM iterations)
+
+void ahrsTask(){
+#if AHRS_DATA_READY == 0 //Else the AHRS follows the sensors data ready lines (as main.c)
+	AhrsCompute();
+#endif
+}
+
+void compassTask(){
+	AhrsCompass();
+}
+
+SchedulerTask tasks[] = {
+	{ahrsTask, SCHEDULER_HZ(AHRS_HZ), 0},
+	{compassTask, SCHEDULER_HZ(COMPASS_HZ), 500}
+};
+
+//*************************************
+//MAIN
+//*************************************
+
+int main(int argc, char *argv[]){
+
+	double duration = 60;
+	uint32_t printMs = 100;
+	const char *replay = NULL;
+	const char *record = NULL;
+
+	for(int i = 1 ; i + 1 < argc ; i += 2){
+		if(!strcmp(argv[i], "-t")){
+			duration = atof(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-r")){
+			replay = argv[i + 1];
+		}
+		else if(!strcmp(argv[i], "-w")){
+			record = argv[i + 1];
+		}
+		else if(!strcmp(argv[i], "-p")){
+			printMs = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-n")){
+			hostTwiNackEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-h")){
+			hostTwiHangEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-s")){
+			hostMotionSeed = atoi(argv[i + 1]);
+		}
+		else{
+			fprintf(stderr, "Usage: %s [-t seconds] [-r file] [-w file] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(record != NULL){
+		return hostMotionWrite(record, duration, 1000) ? 0 : 1;
+	}
+
+	HostMotionSource motion = hostMotionSynthetic;
+	if(replay != NULL){
+		duration = hostMotionLoad(replay);
+		if(duration <= 0){
+			return 1;
+		}
+		motion = hostMotionReplay;
+	}
+
+	//Pololu MinIMU-9 v2
+	HostImuChip gyroChip;
+	HostImuChip accelChip;
+	hostL3g4200dInit(&gyroChip, gyroAdd, motion);
+	hostLsm303dInit(&accelChip, accelAdd, motion);
+#if AHRS_DATA_READY == 1
+	hostImuConnectInterrupt(&gyroChip, &PINB, GYRO_DRDY_PIN);
+	hostImuConnectInterrupt(&accelChip, &PINB, ACCEL_DRDY_PIN);
+#endif
+
+	clock_t wallStart = clock();
+
+	//Same start as main.c, without the LED delays and the PMW
+	TCCR1B |= 1<<CS11;
+	clockInit(0);
+	sei();
+	TWSR = 0x00;
+	TWBR = 0x02;
+	AhrsInit();
+	schedulerInit(tasks, sizeof(tasks) / sizeof(tasks[0]));
+	sei();
+
+	if(printMs > 0){
+		printf("t,roll,pitch,yaw,true_roll,true_pitch,true_yaw\n");
+	}
+
+	uint64_t endUs = (uint64_t)(duration * 1e6);
+	uint64_t nextErrorUs = SIM_SETTLE_US;
+	uint64_t nextPrintUs = 0;
+	HostAttitudeErrors errors = {{0, 0, 0}, {0, 0, 0}, 0};
+
+	while(hostMicros() < endUs){
+
+		schedulerRun();
+#if (AHRS_TWI_ASYNC == 1) || (AHRS_DATA_READY == 1)
+		AhrsPoll();
+#endif
+		halIdle();
+
+		uint64_t now = hostMicros();
+		double truth[3];
+		AhrsEuler();
+		double estimate[3] = {ToDeg(roll), ToDeg(pitch), ToDeg(yaw)};
+		uint8_t known = hostMotionTruth(now * 1e-6, truth);
+
+		if((printMs > 0) && (now >= nextPrintUs)){
+			nextPrintUs = (now / (printMs * 1000UL) + 1) * printMs * 1000UL;
+			if(known){
+				printf("%.3f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", now * 1e-6, estimate[0], estimate[1], estimate[2], truth[0], truth[1], truth[2]);
+			}
+			else{
+				printf("%.3f,%.2f,%.2f,%.2f,,,\n", now * 1e-6, estimate[0], estimate[1], estimate[2]);
+			}
+		}
+
+		if(known && (now >= nextErrorUs)){
+			nextErrorUs += SIM_ERROR_US;
+			hostAttitudeError(&errors, estimate, truth);
+		}
+	}
+
+	double wallSeconds = (double)(clock() - wallStart) / CLOCKS_PER_SEC;
+
+	hostRunReport(&gyroChip, &accelChip, duration, wallSeconds);
+	hostAttitudeReport(&errors);
+
+	//Nothing injected: any failed transaction is a driver or AHRS fault
+	if((hostTwiNacks == 0) && (hostTwiHangs == 0) && ((gyroErrors > 0) || (accelErrors > 0))){
+		fprintf(stderr, "FAILED: TWI errors without injected fault\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,18 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <avr/interrupt.h>.
+//An ISR is a plain function, called by the simulated MCU (host_avr.c).
+//*****************************************
+
+#ifndef HOST_AVR_INTERRUPT
+#define HOST_AVR_INTERRUPT
+
+#include "host_avr.h"
+
+#define ISR(vector) void vector(void)
+
+#define sei() hostSei()
+#define cli() hostCli()
+
+#endif
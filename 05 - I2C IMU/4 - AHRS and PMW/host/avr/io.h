@@ -0,0 +1,126 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <avr/io.h> (ATmega328p registers used by the project).
+//Registers are plain variables, updated by the simulated MCU (host_avr.c).
+//TWCR goes through hostTwcr() : the TWI engine sees each write.
+//TCNT1 goes through hostTcnt1() : reading it takes time.
+//*****************************************
+
+#ifndef HOST_AVR_IO
+#define HOST_AVR_IO
+
+#include <stdint.h>
+
+#include "host_avr.h"
+
+//TWI
+#define TWCR (*hostTwcr())
+extern volatile uint8_t TWSR;
+extern volatile uint8_t TWBR;
+extern volatile uint8_t TWDR;
+extern volatile uint8_t TWAR;
+
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
+
+//Timer 1
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+#define TCNT1 (*hostTcnt1())
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint16_t ICR1;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+
+//Ports
+extern volatile uint8_t PORTB;
+extern volatile uint8_t PORTC;
+extern volatile uint8_t PORTD;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t DDRC;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t PINB;
+extern volatile uint8_t PINC;
+extern volatile uint8_t PIND;
+
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTC4 4
+#define PORTC5 5
+#define PORTD0 0
+#define PORTD1 1
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PORTD7 7
+#define DDB0 0
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+#define DDB4 4
+#define DDB5 5
+#define DDC4 4
+#define DDC5 5
+#define DDD0 0
+#define DDD1 1
+#define DDD2 2
+#define DDD3 3
+#define DDD4 4
+#define DDD5 5
+#define DDD6 6
+#define DDD7 7
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINC4 4
+#define PINC5 5
+
+//Pin change interrupts
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCIFR;
+extern volatile uint8_t PCMSK0;
+
+#define PCIE0 0
+#define PCIF0 0
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+#define PCINT7 7
+
+#endif
@@ -0,0 +1,130 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Native build of the whole flight code : main.c as is (PMW, scheduler, motors
+//sequence and AHRS) on the simulated ATmega328p (host_avr.c), against the
+//L3G4200D and LSM303D models (host_sensors.c) moved by host_motion.h.
+//main() of main.c is renamed flightMain(), its loop never ends : the run
+//is checked and stopped in flightIdle(), called by halIdle() at each pass.
+//
+//Usage : flight_sim [-t seconds] [-r file] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]
+//Prints the estimated and true angles and servo[] every -p ms (0 : none) on stdout,
+//the errors (while the AHRS runs) and statistics on stderr.
+//*****************************************
+
+#include <time.h>
+
+#define main flightMain
+#include "../main.c"
+#undef main
+
+#include "host_sensors.h"
+#include "host_motion.h"
+
+#define SIM_ERROR_US 10000 //Errors sampled every 10ms
+#define SIM_SETTLE_US 500000 //Errors counted 0.5s after the AHRS start
+
+HostImuChip gyroChip;
+HostImuChip accelChip;
+
+uint64_t simEndUs;
+uint32_t simPrintMs = 100;
+uint64_t simNextPrintUs = 0;
+uint64_t simNextErrorUs = 0;
+uint64_t simAhrsStartUs = 0;
+HostAttitudeErrors simErrors;
+clock_t simWallStart;
+
+//End of each main loop pass
+void flightIdle(){
+
+	uint64_t now = hostMicros();
+	double truth[3];
+	AhrsEuler();
+	double estimate[3] = {ToDeg(roll), ToDeg(pitch), ToDeg(yaw)};
+	uint8_t known = hostMotionTruth(now * 1e-6, truth);
+
+	if((simPrintMs > 0) && (now >= simNextPrintUs)){
+		simNextPrintUs = (now / (simPrintMs * 1000UL) + 1) * simPrintMs * 1000UL;
+		printf("%.3f,%u,%.2f,%.2f,%.2f,", now * 1e-6, ahrsRunning, estimate[0], estimate[1], estimate[2]);
+		if(known){
+			printf("%.2f,%.2f,%.2f,", truth[0], truth[1], truth[2]);
+		}
+		else{
+			printf(",,,");
+		}
+		printf("%u,%u,%u,%u\n", servo[0], servo[1], servo[2], servo[3]);
+	}
+
+	if(!ahrsRunning){
+		simAhrsStartUs = 0;
+	}
+	else if(simAhrsStartUs == 0){
+		simAhrsStartUs = now;
+		simNextErrorUs = now + SIM_SETTLE_US;
+	}
+	else if(known && (now >= simNextErrorUs)){
+		simNextErrorUs += SIM_ERROR_US;
+		hostAttitudeError(&simErrors, estimate, truth);
+	}
+
+	if(now >= simEndUs){
+		double wallSeconds = (double)(clock() - simWallStart) / CLOCKS_PER_SEC;
+		hostRunReport(&gyroChip, &accelChip, now * 1e-6, wallSeconds);
+		hostAttitudeReport(&simErrors);
+		exit(0);
+	}
+}
+
+int main(int argc, char *argv[]){
+
+	double duration = 16; //Motors sequence of main.c : AHRS from 7 to 15s
+
+	hostMotionStart = 8.0; //Offsets computed at 3s, AHRS started at 7s
+
+	for(int i = 1 ; i + 1 < argc ; i += 2){
+		if(!strcmp(argv[i], "-t")){
+			duration = atof(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-r")){
+			duration = hostMotionLoad(argv[i + 1]);
+			if(duration <= 0){
+				return 1;
+			}
+		}
+		else if(!strcmp(argv[i], "-p")){
+			simPrintMs = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-n")){
+			hostTwiNackEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-h")){
+			hostTwiHangEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-s")){
+			hostMotionSeed = atoi(argv[i + 1]);
+		}
+		else{
+			fprintf(stderr, "Usage: %s [-t seconds] [-r file] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	HostMotionSource motion = (hostMotionRecords != NULL) ? hostMotionReplay : hostMotionSynthetic;
+	hostL3g4200dInit(&gyroChip, gyroAdd, motion);
+	hostLsm303dInit(&accelChip, accelAdd, motion);
+#if AHRS_DATA_READY == 1
+	hostImuConnectInterrupt(&gyroChip, &PINB, GYRO_DRDY_PIN);
+	hostImuConnectInterrupt(&accelChip, &PINB, ACCEL_DRDY_PIN);
+#endif
+
+	if(simPrintMs > 0){
+		printf("t,ahrs,roll,pitch,yaw,true_roll,true_pitch,true_yaw,servo0,servo1,servo2,servo3\n");
+	}
+
+	simEndUs = (uint64_t)(duration * 1e6);
+	simWallStart = clock();
+	hostIdleHook = flightIdle;
+
+	return flightMain();
+}
@@ -0,0 +1,469 @@
+#include <stddef.h>
+
+#include <avr/io.h>
+
+#include "host_avr.h"
+
+//Interrupt vectors of the flight code (ISR() functions), absent ones are null
+void PCINT0_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_OVF_vect(void) __attribute__((weak));
+void TWI_vect(void) __attribute__((weak));
+
+//Registers
+volatile uint8_t TWSR = 0xF8;
+volatile uint8_t TWBR = 0;
+volatile uint8_t TWDR = 0xFF;
+volatile uint8_t TWAR = 0;
+
+volatile uint8_t TCCR1A = 0;
+volatile uint8_t TCCR1B = 0;
+volatile uint16_t hostTcnt1Register = 0; //TCNT1, see hostTcnt1()
+volatile uint16_t OCR1A = 0;
+volatile uint16_t OCR1B = 0;
+volatile uint16_t ICR1 = 0;
+volatile uint8_t TIMSK1 = 0;
+volatile uint8_t TIFR1 = 0;
+
+volatile uint8_t PORTB = 0;
+volatile uint8_t PORTC = 0;
+volatile uint8_t PORTD = 0;
+volatile uint8_t DDRB = 0;
+volatile uint8_t DDRC = 0;
+volatile uint8_t DDRD = 0;
+volatile uint8_t PINB = 0;
+volatile uint8_t PINC = 1<<PINC4 | 1<<PINC5; //SDA and SCL pulled up
+volatile uint8_t PIND = 0;
+
+volatile uint8_t PCICR = 0;
+volatile uint8_t PCIFR = 0;
+volatile uint8_t PCMSK0 = 0;
+
+uint64_t hostCycles = 0;
+
+uint8_t hostInterrupts = 0; //I flag
+
+void (*hostInterruptHook)(void) = NULL;
+
+//*************************************
+//TIMER 1 (normal mode)
+//*************************************
+
+#define HOST_TCNT1_READ_CYCLES 4 //Cost of a TCNT1 read
+
+uint32_t hostTimerCycles = 0; //Cycles not counted yet by the prescaler
+
+//Cycles per Timer 1 tick, 0 when stopped
+uint16_t hostTimerPrescaler(){
+	switch(TCCR1B & (1<<CS12 | 1<<CS11 | 1<<CS10)){
+		case 1: return 1;
+		case 2: return 8;
+		case 3: return 64;
+		case 4: return 256;
+		case 5: return 1024;
+		default: return 0;
+	}
+}
+
+//Cycle of the next overflow or compare match
+uint64_t hostTimerNextEvent(){
+	uint16_t prescaler = hostTimerPrescaler();
+	if(prescaler == 0){
+		return UINT64_MAX;
+	}
+
+	uint32_t ticks = 0x10000UL - hostTcnt1Register;
+	uint32_t compareTicks = (uint16_t)(OCR1A - hostTcnt1Register);
+	if((compareTicks > 0) && (compareTicks < ticks)){
+		ticks = compareTicks;
+	}
+
+	return hostCycles + (uint64_t)ticks * prescaler - hostTimerCycles;
+}
+
+//Count the ticks of these cycles (never past the next event)
+void hostTimerRun(uint64_t cycles){
+	uint16_t prescaler = hostTimerPrescaler();
+	if(prescaler == 0){
+		return;
+	}
+
+	uint64_t total = hostTimerCycles + cycles;
+	uint32_t ticks = total / prescaler;
+	hostTimerCycles = total % prescaler;
+
+	if(ticks > 0){
+		uint32_t compareTicks = (uint16_t)(OCR1A - hostTcnt1Register);
+		if((compareTicks > 0) && (compareTicks <= ticks)){
+			TIFR1 |= 1<<OCF1A;
+		}
+		if(hostTcnt1Register + ticks > 0xFFFF){
+			TIFR1 |= 1<<TOV1;
+		}
+		hostTcnt1Register = hostTcnt1Register + ticks;
+	}
+}
+
+//A TCNT1 read costs a few cycles : a loop waiting on it (PMW pulse end) sees the time go on
+volatile uint16_t *hostTcnt1(){
+	hostRunCycles(HOST_TCNT1_READ_CYCLES);
+	return &hostTcnt1Register;
+}
+
+//*************************************
+//TWI MASTER
+//*************************************
+
+#define HOST_TWCR_SEEN (1<<1) //Reserved TWCR bit : set once a write is taken into account
+#define HOST_TWI_POLL_CYCLES 6 //Cost of a TWCR read in a wait loop
+
+#define HOST_TWI_START 0
+#define HOST_TWI_STOP 1
+#define HOST_TWI_STOP_START 2
+#define HOST_TWI_BYTE 3
+
+volatile uint8_t hostTwcrRegister = HOST_TWCR_SEEN;
+
+HostTwiSlave *hostTwiSlaves = NULL;
+HostTwiSlave *hostTwiAddressed = NULL; //Slave of the running transaction
+
+uint8_t hostTwiFlag = 0; //TWINT
+uint8_t hostTwiBusy = 0; //An action runs
+uint8_t hostTwiAction;
+uint8_t hostTwiCommand; //TWCR value that started the action
+uint8_t hostTwiData; //TWDR when the action started
+uint64_t hostTwiDoneAt;
+uint8_t hostTwiOwner = 0; //START sent, no STOP yet
+uint8_t hostTwiStatus = 0xF8;
+
+uint16_t hostTwiNackEvery = 0;
+uint16_t hostTwiHangEvery = 0;
+uint32_t hostTwiActions = 0;
+uint32_t hostTwiNacks = 0;
+uint32_t hostTwiHangs = 0;
+uint64_t hostTwiBusyCycles = 0;
+uint32_t hostTwiAddressings = 0;
+
+void hostTwiAttach(HostTwiSlave *slave){
+	slave->next = hostTwiSlaves;
+	hostTwiSlaves = slave;
+}
+
+//CPU cycles of one SCL period
+uint32_t hostTwiBitCycles(){
+	static const uint8_t prescalers[4] = {1, 4, 16, 64};
+	return 16 + 2UL * TWBR * prescalers[TWSR & 0x03];
+}
+
+//End the transfer with the addressed slave
+void hostTwiRelease(){
+	if(hostTwiAddressed != NULL){
+		if(hostTwiAddressed->stop != NULL){
+			hostTwiAddressed->stop(hostTwiAddressed);
+		}
+		hostTwiAddressed = NULL;
+	}
+}
+
+void hostTwiSetStatus(uint8_t status){
+	hostTwiStatus = status;
+	TWSR = status | (TWSR & 0x03);
+}
+
+//Start the bus action asked by a TWCR write (TWINT written to one)
+void hostTwiStartAction(uint8_t command){
+
+	hostTwiCommand = command;
+	hostTwiData = TWDR;
+	hostTwiBusy = 1;
+	hostTwiActions++;
+
+	if((command & (1<<TWSTO)) && (command & (1<<TWSTA))){
+		hostTwiAction = HOST_TWI_STOP_START;
+		hostTwiDoneAt = hostCycles + 2 * hostTwiBitCycles();
+	}
+	else if(command & (1<<TWSTO)){
+		hostTwiAction = HOST_TWI_STOP;
+		hostTwiDoneAt = hostCycles + hostTwiBitCycles();
+	}
+	else if(command & (1<<TWSTA)){
+		hostTwiAction = HOST_TWI_START;
+		hostTwiDoneAt = hostCycles + hostTwiBitCycles();
+	}
+	else{
+		hostTwiAction = HOST_TWI_BYTE;
+		hostTwiDoneAt = hostCycles + 9 * hostTwiBitCycles(); //8 bits and ACK
+	}
+
+	if((hostTwiHangEvery > 0) && ((hostTwiActions % hostTwiHangEvery) == 0)){
+		hostTwiDoneAt = UINT64_MAX; //Slave holding SCL low
+		hostTwiHangs++;
+	}
+}
+
+void hostTwiStart(){
+	hostTwiSetStatus(hostTwiOwner ? 0x10 : 0x08);
+	hostTwiOwner = 1;
+}
+
+void hostTwiStop(){
+	hostTwiRelease();
+	hostTwiOwner = 0;
+	hostTwcrRegister &= ~(1<<TWSTO);
+}
+
+//Address, write or read a byte
+void hostTwiByte(){
+	uint8_t status = hostTwiStatus;
+
+	if((status == 0x08) || (status == 0x10)){ //SLA+R/W
+		uint8_t address = hostTwiData >> 1;
+		uint8_t isRead = hostTwiData & 0x01;
+		HostTwiSlave *slave = hostTwiSlaves;
+
+		while((slave != NULL) && (slave->address != address)){
+			slave = slave->next;
+		}
+		if(slave != hostTwiAddressed){
+			hostTwiRelease();
+		}
+
+		hostTwiAddressings++;
+		if((hostTwiNackEvery > 0) && ((hostTwiAddressings % hostTwiNackEvery) == 0)){
+			slave = NULL;
+			hostTwiNacks++;
+		}
+
+		if(slave != NULL){
+			hostTwiAddressed = slave;
+			slave->start(slave, isRead);
+			hostTwiSetStatus(isRead ? 0x40 : 0x18);
+		}
+		else{
+			hostTwiRelease();
+			hostTwiSetStatus(isRead ? 0x48 : 0x20);
+		}
+	}
+	else if((status == 0x18) || (status == 0x28)){ //Data written
+		if(hostTwiAddressed->write(hostTwiAddressed, hostTwiData)){
+			hostTwiSetStatus(0x28);
+		}
+		else{
+			hostTwiSetStatus(0x30);
+		}
+	}
+	else if((status == 0x40) || (status == 0x50)){ //Data read, ACK or NACK from TWEA
+		TWDR = hostTwiAddressed->read(hostTwiAddressed);
+		hostTwiSetStatus((hostTwiCommand & (1<<TWEA)) ? 0x50 : 0x58);
+	}
+	else{ //Nothing to send or receive
+		hostTwiRelease();
+		hostTwiOwner = 0;
+		hostTwiSetStatus(0x00);
+	}
+}
+
+//The running action ends
+void hostTwiComplete(){
+	hostTwiBusy = 0;
+
+	switch(hostTwiAction){
+		case HOST_TWI_START:
+			hostTwiStart();
+			break;
+		case HOST_TWI_STOP:
+			hostTwiStop();
+			return; //No TWINT after a STOP
+		case HOST_TWI_STOP_START:
+			hostTwiStop();
+			hostTwiStart();
+			break;
+		default:
+			hostTwiByte();
+			break;
+	}
+
+	hostTwiFlag = 1;
+	hostTwcrRegister |= 1<<TWINT;
+}
+
+//Take a TWCR write into account
+void hostTwiLatch(){
+	uint8_t value = hostTwcrRegister;
+
+	if(value & HOST_TWCR_SEEN){
+		return;
+	}
+
+	if(!(value & (1<<TWEN))){ //TWI disabled : the pins are back to PORTC, the bus is left
+		hostTwiBusy = 0;
+		hostTwiFlag = 0;
+		hostTwiRelease();
+		hostTwiOwner = 0;
+		hostTwcrRegister = value | HOST_TWCR_SEEN;
+		return;
+	}
+
+	if(value & (1<<TWINT)){ //Flag cleared, action started
+		hostTwiFlag = 0;
+		hostTwcrRegister = (value & ~(1<<TWINT)) | HOST_TWCR_SEEN;
+		hostTwiStartAction(value);
+	}
+	else{ //Flag unchanged
+		hostTwcrRegister = value | (hostTwiFlag ? (1<<TWINT) : 0) | HOST_TWCR_SEEN;
+	}
+}
+
+volatile uint8_t *hostTwcr(){
+	hostTwiLatch();
+
+	//Without TWIE, TWCR is read by a wait loop : let the running action go on
+	if(hostTwiBusy && !(hostTwcrRegister & (1<<TWIE))){
+		if(hostTwiDoneAt == UINT64_MAX){
+			hostRunCycles(HOST_TWI_POLL_CYCLES);
+		}
+		else if(hostTwiDoneAt > hostCycles){
+			hostRunCycles(hostTwiDoneAt - hostCycles);
+		}
+	}
+
+	return &hostTwcrRegister;
+}
+
+//*************************************
+//PINS AND INTERRUPTS
+//*************************************
+
+void hostSetPin(volatile uint8_t *pin, uint8_t bit, uint8_t level){
+	uint8_t old = *pin;
+
+	if(level){
+		*pin |= 1<<bit;
+	}
+	else{
+		*pin &= ~(1<<bit);
+	}
+
+	if((pin == &PINB) && (old != *pin) && (PCMSK0 & (1<<bit))){
+		PCIFR |= 1<<PCIF0;
+	}
+}
+
+//Run the pending interrupts, by vector priority
+void hostDispatch(){
+
+	while(hostInterrupts){
+		void (*vector)(void) = NULL;
+
+		if((PCICR & (1<<PCIE0)) && (PCIFR & (1<<PCIF0)) && (PCINT0_vect != NULL)){
+			PCIFR &= ~(1<<PCIF0);
+			vector = PCINT0_vect;
+		}
+		else if((TIMSK1 & (1<<OCIE1A)) && (TIFR1 & (1<<OCF1A)) && (TIMER1_COMPA_vect != NULL)){
+			TIFR1 &= ~(1<<OCF1A);
+			vector = TIMER1_COMPA_vect;
+		}
+		else if((TIMSK1 & (1<<TOIE1)) && (TIFR1 & (1<<TOV1)) && (TIMER1_OVF_vect != NULL)){
+			TIFR1 &= ~(1<<TOV1);
+			vector = TIMER1_OVF_vect;
+		}
+		else if((hostTwcrRegister & (1<<TWIE)) && hostTwiFlag && (TWI_vect != NULL)){
+			vector = TWI_vect; //TWINT is cleared by the ISR itself
+		}
+		else{
+			break;
+		}
+
+		hostInterrupts = 0;
+		vector();
+		hostInterrupts = 1;
+		hostTwiLatch();
+		if(hostInterruptHook != NULL){
+			hostInterruptHook();
+		}
+
+		if((vector == TWI_vect) && hostTwiFlag){
+			break; //TWI_vect left TWINT set, it would run forever
+		}
+	}
+}
+
+void hostSei(){
+	hostInterrupts = 1;
+	hostDispatch();
+}
+
+void hostCli(){
+	hostInterrupts = 0;
+}
+
+uint8_t hostSaveInterrupts(){
+	uint8_t interrupts = hostInterrupts;
+	hostInterrupts = 0;
+	return interrupts;
+}
+
+void hostRestoreInterrupts(uint8_t interrupts){
+	hostInterrupts = interrupts;
+	if(interrupts){
+		hostDispatch();
+	}
+}
+
+//*************************************
+//TIME
+//*************************************
+
+uint64_t hostMicros(){
+	return hostCycles / (HOST_F_CPU / 1000000UL);
+}
+
+void hostRunCycles(uint64_t cycles){
+
+	uint64_t end = hostCycles + cycles;
+
+	do{
+		hostTwiLatch();
+
+		//Next hardware event
+		uint64_t next = end;
+		if(hostTwiBusy && (hostTwiDoneAt < next)){
+			next = hostTwiDoneAt;
+		}
+		uint64_t timerEvent = hostTimerNextEvent();
+		if(timerEvent < next){
+			next = timerEvent;
+		}
+		for(HostTwiSlave *slave = hostTwiSlaves ; slave != NULL ; slave = slave->next){
+			uint64_t slaveEvent = slave->nextEvent(slave) * (HOST_F_CPU / 1000000UL);
+			if(slaveEvent < next){
+				next = (slaveEvent > hostCycles) ? slaveEvent : hostCycles + 1;
+			}
+		}
+
+		if(hostTwiOwner || hostTwiBusy){
+			hostTwiBusyCycles += next - hostCycles;
+		}
+		hostTimerRun(next - hostCycles);
+		hostCycles = next;
+
+		if(hostTwiBusy && (hostCycles >= hostTwiDoneAt)){
+			hostTwiComplete();
+		}
+		for(HostTwiSlave *slave = hostTwiSlaves ; slave != NULL ; slave = slave->next){
+			slave->update(slave, hostMicros());
+		}
+
+		hostDispatch();
+
+	}while(hostCycles < end);
+}
+
+void (*hostIdleHook)(void) = NULL;
+
+void hostIdle(){
+	hostRunCycles(HOST_IDLE_CYCLES);
+	if(hostIdleHook != NULL){
+		hostIdleHook();
+	}
+}
@@ -0,0 +1,76 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Simulated ATmega328p for host (Linux) runs of the flight code.
+//Time only goes forward in hostRunCycles() (called by the _delay functions,
+//the TWI waits, TCNT1 reads and hostIdle()). Timer 1, pin change interrupts and
+//the TWI master are modelled at register level, the interrupts run between
+//two steps when the I flag is set.
+//TWI slaves (host_sensors.c) are attached with hostTwiAttach().
+//*****************************************
+
+#ifndef HOST_AVR
+#define HOST_AVR
+
+#include <stdint.h>
+
+#define HOST_F_CPU 8000000UL
+
+//Simulated time
+extern uint64_t hostCycles;
+
+//Simulated microseconds since the start
+uint64_t hostMicros();
+
+//Run the simulated MCU for a number of CPU cycles (hardware events and interrupts)
+void hostRunCycles(uint64_t cycles);
+
+//Interrupt flag (I bit of SREG)
+void hostSei();
+void hostCli();
+uint8_t hostSaveInterrupts(); //Return the I flag and clear it
+void hostRestoreInterrupts(uint8_t interrupts);
+
+//End of a main loop pass (halIdle() of monni_hal.h) : run HOST_IDLE_CYCLES, then hostIdleHook
+//(the simulation checks its outputs there and calls exit() at the end of the run)
+#define HOST_IDLE_CYCLES 200
+extern void (*hostIdleHook)(void);
+void hostIdle();
+
+//Called after each interrupt vector (the outputs it changed can be timed there)
+extern void (*hostInterruptHook)(void);
+
+//TWCR and TCNT1 access, see avr/io.h
+volatile uint8_t *hostTwcr();
+volatile uint16_t *hostTcnt1();
+
+//Set an input pin driven by the outside (PINB only raises pin change interrupts)
+void hostSetPin(volatile uint8_t *pin, uint8_t bit, uint8_t level);
+
+//TWI slave model. The first byte written after SLA+W is the register address.
+typedef struct HostTwiSlave HostTwiSlave;
+
+struct HostTwiSlave {
+	uint8_t address; //7 bits address
+	void (*start)(HostTwiSlave *slave, uint8_t isRead); //Addressed by SLA+R/W
+	uint8_t (*write)(HostTwiSlave *slave, uint8_t data); //Return 1 to ACK
+	uint8_t (*read)(HostTwiSlave *slave); //Next byte to send
+	void (*stop)(HostTwiSlave *slave); //STOP or REPEATED START to another slave
+	void (*update)(HostTwiSlave *slave, uint64_t us); //Time goes on (samples, pins)
+	uint64_t (*nextEvent)(HostTwiSlave *slave); //Microseconds of the next update needed
+	HostTwiSlave *next;
+};
+
+void hostTwiAttach(HostTwiSlave *slave);
+
+//TWI fault injection (0 : never)
+extern uint16_t hostTwiNackEvery; //NACK one SLA+R/W out of hostTwiNackEvery
+extern uint16_t hostTwiHangEvery; //One bus action out of hostTwiHangEvery never ends (until TWI is disabled)
+
+//TWI statistics
+extern uint32_t hostTwiActions; //START, STOP and bytes
+extern uint32_t hostTwiNacks;
+extern uint32_t hostTwiHangs;
+extern uint64_t hostTwiBusyCycles; //Cycles the bus was not idle
+
+#endif
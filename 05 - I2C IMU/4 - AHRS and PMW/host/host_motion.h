@@ -0,0 +1,303 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Motion seen by the simulated sensors (host_sensors.h), attitude errors and run report.
+//Synthetic : still and level until hostMotionStart, then roll, pitch and a yaw
+//rotation, with noise and gyro bias.
+//Replayed : a text file, one sample per line :
+//t gx gy gz ax ay az mx my mz [roll pitch yaw]
+//in seconds, dps, g and gauss on the sensors axes, optional true angles in degrees.
+//Include it after monni_ahrs.h (sensors signs and magnetometer calibration).
+//*****************************************
+
+#ifndef HOST_MOTION
+#define HOST_MOTION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "host_sensors.h"
+
+//Synthetic motion
+#define HOST_MOTION_ROLL_DEG 30.0
+#define HOST_MOTION_ROLL_HZ 0.2
+#define HOST_MOTION_PITCH_DEG 20.0
+#define HOST_MOTION_PITCH_HZ 0.13
+#define HOST_MOTION_YAW_DPS 20.0
+#define HOST_MOTION_INCLINATION_DEG 60.0 //Magnetic field 60 degrees below the horizon
+#define HOST_MOTION_GYRO_BIAS_DPS 0.5 //Removed by the AhrsInit() offsets
+#define HOST_MOTION_GYRO_NOISE_DPS 0.3
+#define HOST_MOTION_ACCEL_NOISE_G 0.003
+#define HOST_MOTION_MAG_NOISE 0.003 //Of the calibrated range
+
+double hostMotionStart = 3.0; //Seconds still and level : the offsets are computed there
+uint32_t hostMotionSeed = 1;
+
+//Replayed motion
+typedef struct {
+	double t;
+	double values[9]; //gx gy gz ax ay az mx my mz
+	double truth[3]; //Degrees
+} HostMotionRecord;
+
+HostMotionRecord *hostMotionRecords = NULL;
+uint32_t hostMotionNbRecords = 0;
+uint8_t hostMotionHasTruth = 0;
+
+//Gaussian noise (Box-Muller on a LCG), same sequence for a same seed
+double hostMotionNoise(double sigma){
+	double u[2];
+	for(uint8_t i = 0 ; i < 2 ; i++){
+		hostMotionSeed = hostMotionSeed * 1103515245UL + 12345UL;
+		u[i] = ((hostMotionSeed >> 8) + 1.0) / 16777217.0;
+	}
+	return sigma * sqrt(-2.0 * log(u[0])) * cos(2.0 * M_PI * u[1]);
+}
+
+//True angles (radians) and their derivatives
+void hostMotionAngles(double t, double angles[3], double rates[3]){
+	double tau = t - hostMotionStart;
+
+	if(tau < 0){
+		for(uint8_t i = 0 ; i < 3 ; i++){
+			angles[i] = 0;
+			rates[i] = 0;
+		}
+		return;
+	}
+
+	double wr = 2.0 * M_PI * HOST_MOTION_ROLL_HZ;
+	double wp = 2.0 * M_PI * HOST_MOTION_PITCH_HZ;
+	angles[0] = ToRad(HOST_MOTION_ROLL_DEG) * sin(wr * tau);
+	rates[0] = ToRad(HOST_MOTION_ROLL_DEG) * wr * cos(wr * tau);
+	angles[1] = ToRad(HOST_MOTION_PITCH_DEG) * sin(wp * tau);
+	rates[1] = ToRad(HOST_MOTION_PITCH_DEG) * wp * cos(wp * tau);
+	angles[2] = remainder(ToRad(HOST_MOTION_YAW_DPS) * tau, 2.0 * M_PI);
+	rates[2] = ToRad(HOST_MOTION_YAW_DPS);
+}
+
+//Body axes (x forward, y right, z down) values to the sensors raw axes of monni_ahrs.h, with noise and gyro bias.
+//rate : rad/s, accel : g as seen by Drift_correction() (gravity minus acceleration, 1 on Z when level and still),
+//mag : unit vector of the magnetic field
+void hostMotionFromBody(double rate[3], double accel[3], double mag[3], HostMotion *motion){
+
+	//Calibrated range of Compass_Heading() (M_x_MIN to M_x_MAX is -0.5 to 0.5), 0.160mgauss/LSB
+	const double magMin[3] = {M_X_MIN, M_Y_MIN, M_Z_MIN};
+	const double magMax[3] = {M_X_MAX, M_Y_MAX, M_Z_MAX};
+	const int8_t sign[9] = {GYRO_SIGN_X, GYRO_SIGN_Y, GYRO_SIGN_Z, ACCEL_SIGN_X, ACCEL_SIGN_Y, ACCEL_SIGN_Z, MAG_SIGN_X, MAG_SIGN_Y, MAG_SIGN_Z};
+
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		motion->gyro[i] = sign[i] * ToDeg(rate[i]) + HOST_MOTION_GYRO_BIAS_DPS + hostMotionNoise(HOST_MOTION_GYRO_NOISE_DPS);
+		motion->accel[i] = sign[3 + i] * accel[i] + hostMotionNoise(HOST_MOTION_ACCEL_NOISE_G);
+		double unit = sign[6 + i] * (mag[i] / 2.0 + hostMotionNoise(HOST_MOTION_MAG_NOISE));
+		motion->mag[i] = (magMin[i] + (magMax[i] - magMin[i]) * (0.5 + unit)) * 0.00016;
+	}
+}
+
+//Magnetic field (unit vector) in body axes, from the body to north-east-down rotation matrix
+void hostMotionMagnetic(double r[3][3], double mag[3]){
+	double ned[3] = {cos(ToRad(HOST_MOTION_INCLINATION_DEG)), 0, sin(ToRad(HOST_MOTION_INCLINATION_DEG))};
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		mag[i] = r[0][i] * ned[0] + r[1][i] * ned[1] + r[2][i] * ned[2];
+	}
+}
+
+//Body to north-east-down rotation matrix of Euler angles (radians), as DCM_Matrix
+void hostMotionMatrix(double angles[3], double r[3][3]){
+	double sr = sin(angles[0]), cr = cos(angles[0]);
+	double sp = sin(angles[1]), cp = cos(angles[1]);
+	double sy = sin(angles[2]), cy = cos(angles[2]);
+
+	r[0][0] = cp * cy;
+	r[0][1] = sr * sp * cy - cr * sy;
+	r[0][2] = cr * sp * cy + sr * sy;
+	r[1][0] = cp * sy;
+	r[1][1] = sr * sp * sy + cr * cy;
+	r[1][2] = cr * sp * sy - sr * cy;
+	r[2][0] = -sp;
+	r[2][1] = sr * cp;
+	r[2][2] = cr * cp;
+}
+
+void hostMotionSynthetic(double t, HostMotion *motion){
+	double a[3];
+	double d[3];
+	double r[3][3];
+	hostMotionAngles(t, a, d);
+	hostMotionMatrix(a, r);
+
+	double sr = sin(a[0]), cr = cos(a[0]);
+	double sp = sin(a[1]), cp = cos(a[1]);
+
+	//Body rates from the Euler angles rates
+	double rate[3];
+	rate[0] = d[0] - d[2] * sp;
+	rate[1] = d[1] * cr + d[2] * cp * sr;
+	rate[2] = -d[1] * sr + d[2] * cp * cr;
+
+	//Gravity as seen by Drift_correction() : third line of the DCM
+	double accel[3] = {r[2][0], r[2][1], r[2][2]};
+
+	double mag[3];
+	hostMotionMagnetic(r, mag);
+
+	hostMotionFromBody(rate, accel, mag, motion);
+}
+
+//Last record at or before t
+HostMotionRecord *hostMotionRecordAt(double t){
+	uint32_t low = 0;
+	uint32_t high = hostMotionNbRecords - 1;
+
+	while(low < high){
+		uint32_t middle = (low + high + 1) / 2;
+		if(hostMotionRecords[middle].t <= t){
+			low = middle;
+		}
+		else{
+			high = middle - 1;
+		}
+	}
+	return &hostMotionRecords[low];
+}
+
+void hostMotionReplay(double t, HostMotion *motion){
+	HostMotionRecord *record = hostMotionRecordAt(t);
+	memcpy(motion->gyro, &record->values[0], sizeof(motion->gyro));
+	memcpy(motion->accel, &record->values[3], sizeof(motion->accel));
+	memcpy(motion->mag, &record->values[6], sizeof(motion->mag));
+}
+
+//Load a replay file, return the duration in seconds (0 on error)
+double hostMotionLoad(const char *fileName){
+	FILE *file = fopen(fileName, "r");
+	if(file == NULL){
+		perror(fileName);
+		return 0;
+	}
+
+	char line[512];
+	uint32_t size = 0;
+	hostMotionHasTruth = 1;
+
+	while(fgets(line, sizeof(line), file) != NULL){
+		HostMotionRecord record;
+		int fields = sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", &record.t,
+			&record.values[0], &record.values[1], &record.values[2],
+			&record.values[3], &record.values[4], &record.values[5],
+			&record.values[6], &record.values[7], &record.values[8],
+			&record.truth[0], &record.truth[1], &record.truth[2]);
+		if(fields < 10){
+			continue; //Header or comment
+		}
+		if(fields < 13){
+			hostMotionHasTruth = 0;
+		}
+		if(hostMotionNbRecords == size){
+			size = size ? 2 * size : 1024;
+			hostMotionRecords = realloc(hostMotionRecords, size * sizeof(HostMotionRecord));
+		}
+		hostMotionRecords[hostMotionNbRecords++] = record;
+	}
+	fclose(file);
+
+	if(hostMotionNbRecords == 0){
+		fprintf(stderr, "%s: no sample\n", fileName);
+		return 0;
+	}
+	return hostMotionRecords[hostMotionNbRecords - 1].t;
+}
+
+//Write the synthetic motion as a replay file (one sample every periodUs), return 0 on error.
+//Runs to compare on the same samples read it back with hostMotionLoad().
+uint8_t hostMotionWrite(const char *fileName, double duration, uint32_t periodUs){
+	FILE *file = fopen(fileName, "w");
+	if(file == NULL){
+		perror(fileName);
+		return 0;
+	}
+
+	fprintf(file, "#t gx gy gz ax ay az mx my mz roll pitch yaw\n");
+	for(uint64_t us = 0 ; us <= duration * 1e6 ; us += periodUs){
+		double t = us * 1e-6;
+		double angles[3];
+		double rates[3];
+		HostMotion motion;
+		hostMotionSynthetic(t, &motion);
+		hostMotionAngles(t, angles, rates);
+		fprintf(file, "%.6f %.5f %.5f %.5f %.5f %.5f %.5f %.6f %.6f %.6f %.4f %.4f %.4f\n", t,
+			motion.gyro[0], motion.gyro[1], motion.gyro[2],
+			motion.accel[0], motion.accel[1], motion.accel[2],
+			motion.mag[0], motion.mag[1], motion.mag[2],
+			ToDeg(angles[0]), ToDeg(angles[1]), ToDeg(angles[2]));
+	}
+	fclose(file);
+	return 1;
+}
+
+//True angles in degrees, return 0 if unknown
+uint8_t hostMotionTruth(double t, double truth[3]){
+	if(hostMotionRecords != NULL){
+		if(!hostMotionHasTruth){
+			return 0;
+		}
+		memcpy(truth, hostMotionRecordAt(t)->truth, 3 * sizeof(double));
+		return 1;
+	}
+
+	double rates[3];
+	hostMotionAngles(t, truth, rates);
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		truth[i] = ToDeg(truth[i]);
+	}
+	return 1;
+}
+
+//*************************************
+//ATTITUDE ERRORS
+//*************************************
+
+typedef struct {
+	double squares[3];
+	double max[3];
+	uint32_t samples;
+} HostAttitudeErrors;
+
+//Estimated and true roll, pitch and yaw in degrees
+void hostAttitudeError(HostAttitudeErrors *errors, double estimate[3], double truth[3]){
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		double error = fabs(remainder(estimate[i] - truth[i], 360.0));
+		errors->squares[i] += error * error;
+		if(error > errors->max[i]){
+			errors->max[i] = error;
+		}
+	}
+	errors->samples++;
+}
+
+void hostAttitudeReport(HostAttitudeErrors *errors){
+	const char *names[3] = {"roll", "pitch", "yaw"};
+	if(errors->samples == 0){
+		return;
+	}
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		fprintf(stderr, "%-5s error: rms %.2f deg, max %.2f deg\n", names[i], sqrt(errors->squares[i] / errors->samples), errors->max[i]);
+	}
+}
+
+//Speed, sensors and TWI statistics of a run
+void hostRunReport(HostImuChip *gyroChip, HostImuChip *accelChip, double simSeconds, double wallSeconds){
+	fprintf(stderr, "Simulated %.1fs in %.2fs (%.0f simulated seconds per minute)\n", simSeconds, wallSeconds, wallSeconds > 0 ? 60.0 * simSeconds / wallSeconds : 0);
+	fprintf(stderr, "Gyro samples %u (lost %u), accelerometer %u (lost %u), magnetometer %u\n",
+		gyroChip->main.samples, gyroChip->main.lost, accelChip->main.samples, accelChip->main.lost, accelChip->mag.samples);
+	fprintf(stderr, "TWI: %u actions, bus busy %.1f%%, %u NACK and %u hangs injected, %u gyro and %u accelerometer errors\n",
+		hostTwiActions, 100.0 * hostTwiBusyCycles / hostCycles, hostTwiNacks, hostTwiHangs, gyroErrors, accelErrors);
+	fprintf(stderr, "DCM: %u iterations, %u renormalizations\n", ahrsIteration, ahrsRenormalizations);
+#if AHRS_TWI_ASYNC == 1
+	fprintf(stderr, "Longest sweep: %uus\n", ahrsSweepMaxUs);
+#endif
+}
+
+#endif
@@ -0,0 +1,224 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Rigid body model of the quadcopter for the software in the loop simulation
+//(quad_sim.c), moving the simulated sensors (host_sensors.h).
+//- ESC : throttle from the last pulse width (QUAD_ESC_MIN_US to QUAD_ESC_MAX_US),
+//  armed by a first pulse below QUAD_ESC_MIN_US (the 2300us of the start sequence is ignored).
+//- Motors : first order speed response, thrust and drag torque in speed squared.
+//  + configuration : motor 1 (servo[0], PD1) front, 2 right, 3 back, 4 left,
+//  front and back turn clockwise seen from above.
+//- Body : 6 degrees of freedom in north-east-down axes, stopped by the ground
+//  (z = 0) as long as the thrust does not lift it.
+//- Test stand (QUAD_STAND) : the frame center is held, roll and pitch are
+//  pulled back to level by a spring, yaw is damped, and disturbance torques
+//  move it from hostMotionStart.
+//Sensors see the body rates, the specific force and the magnetic field with the
+//noise and bias of host_motion.h.
+//Include it after host_motion.h.
+//*****************************************
+
+#ifndef HOST_QUAD
+#define HOST_QUAD
+
+#include <math.h>
+#include <string.h>
+
+#define QUAD_GRAVITY 9.81
+
+//Airframe
+#define QUAD_MASS 0.60 //kg
+#define QUAD_ARM 0.17 //m, motor to center
+#define QUAD_INERTIA_X 0.006 //kg.m2
+#define QUAD_INERTIA_Y 0.006
+#define QUAD_INERTIA_Z 0.011
+#define QUAD_DRAG 0.10 //N per m/s
+
+//ESC and motors
+#define QUAD_ESC_MIN_US 1060 //Motor stopped below
+#define QUAD_ESC_MAX_US 1860 //Full throttle
+#define QUAD_MOTOR_TAU 0.04 //s, speed time constant
+#define QUAD_MOTOR_THRUST 4.0 //N at full speed
+#define QUAD_MOTOR_TORQUE 0.016 //N.m of drag torque per N of thrust
+
+//Test stand
+#define QUAD_FREE 0
+#define QUAD_STAND 1
+#define QUAD_STAND_SPRING 0.5 //N.m per rad on roll and pitch
+#define QUAD_STAND_DAMPING 0.02 //N.m per rad/s
+#define QUAD_STAND_YAW_DAMPING 0.01 //N.m per rad/s
+#define QUAD_STAND_ROLL_NM 0.12 //Disturbance torques
+#define QUAD_STAND_ROLL_HZ 0.2
+#define QUAD_STAND_PITCH_NM 0.25 //Up to 29 degrees : motor 1 starts from 27 (Ahrs_calculations())
+#define QUAD_STAND_PITCH_HZ 0.13
+#define QUAD_STAND_YAW_NM 0.0035 //20 deg/s with the yaw damping
+
+typedef struct {
+	uint8_t mode; //QUAD_FREE or QUAD_STAND
+	double q[4]; //Body to north-east-down quaternion
+	double rate[3]; //Body rates, rad/s
+	double position[3]; //North-east-down, m (z < 0 in the air)
+	double velocity[3];
+	double acceleration[3]; //Of the last step, for the accelerometer
+	double escUs[4]; //Last pulse width of each motor
+	uint8_t armed[4];
+	double speed[4]; //Motors speed, 0 to 1
+	double t; //Seconds
+} HostQuad;
+
+void hostQuadInit(HostQuad *quad, uint8_t mode){
+	memset(quad, 0, sizeof(HostQuad));
+	quad->mode = mode;
+	quad->q[0] = 1;
+}
+
+//Pulse received by an ESC (motor 0 to 3)
+void hostQuadEsc(HostQuad *quad, uint8_t motor, double widthUs){
+	if(widthUs < QUAD_ESC_MIN_US){
+		quad->armed[motor] = 1;
+	}
+	if(quad->armed[motor]){
+		quad->escUs[motor] = widthUs;
+	}
+}
+
+//Body to north-east-down rotation matrix
+void hostQuadMatrix(HostQuad *quad, double r[3][3]){
+	double w = quad->q[0], x = quad->q[1], y = quad->q[2], z = quad->q[3];
+
+	r[0][0] = 1 - 2 * (y * y + z * z);
+	r[0][1] = 2 * (x * y - w * z);
+	r[0][2] = 2 * (x * z + w * y);
+	r[1][0] = 2 * (x * y + w * z);
+	r[1][1] = 1 - 2 * (x * x + z * z);
+	r[1][2] = 2 * (y * z - w * x);
+	r[2][0] = 2 * (x * z - w * y);
+	r[2][1] = 2 * (y * z + w * x);
+	r[2][2] = 1 - 2 * (x * x + y * y);
+}
+
+//Roll, pitch and yaw in degrees (as Euler_angles())
+void hostQuadAngles(HostQuad *quad, double angles[3]){
+	double r[3][3];
+	hostQuadMatrix(quad, r);
+	angles[0] = ToDeg(atan2(r[2][1], r[2][2]));
+	angles[1] = ToDeg(-asin(fmax(-1.0, fmin(1.0, r[2][0]))));
+	angles[2] = ToDeg(atan2(r[1][0], r[0][0]));
+}
+
+//Thrust of each motor (N) after dt seconds of ESC and motor response
+void hostQuadMotors(HostQuad *quad, double dt, double thrust[4]){
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		double throttle = (quad->escUs[i] - QUAD_ESC_MIN_US) / (QUAD_ESC_MAX_US - QUAD_ESC_MIN_US);
+		throttle = fmax(0.0, fmin(1.0, throttle));
+		quad->speed[i] += (throttle - quad->speed[i]) * dt / QUAD_MOTOR_TAU;
+		thrust[i] = QUAD_MOTOR_THRUST * quad->speed[i] * quad->speed[i];
+	}
+}
+
+//Move the quadcopter by dt seconds
+void hostQuadStep(HostQuad *quad, double dt){
+	double thrust[4];
+	double r[3][3];
+	hostQuadMotors(quad, dt, thrust);
+	hostQuadMatrix(quad, r);
+
+	//Body torques : + configuration, front and back clockwise (reaction torque counter clockwise, -z)
+	double torque[3];
+	torque[0] = QUAD_ARM * (thrust[3] - thrust[1]);
+	torque[1] = QUAD_ARM * (thrust[0] - thrust[2]);
+	torque[2] = QUAD_MOTOR_TORQUE * (thrust[1] + thrust[3] - thrust[0] - thrust[2]);
+
+	if(quad->mode == QUAD_STAND){
+		double angles[3];
+		hostQuadAngles(quad, angles);
+		double tau = quad->t - hostMotionStart;
+		torque[0] += -QUAD_STAND_SPRING * ToRad(angles[0]) - QUAD_STAND_DAMPING * quad->rate[0];
+		torque[1] += -QUAD_STAND_SPRING * ToRad(angles[1]) - QUAD_STAND_DAMPING * quad->rate[1];
+		torque[2] += -QUAD_STAND_YAW_DAMPING * quad->rate[2];
+		if(tau > 0){
+			torque[0] += QUAD_STAND_ROLL_NM * sin(2.0 * M_PI * QUAD_STAND_ROLL_HZ * tau);
+			torque[1] += QUAD_STAND_PITCH_NM * sin(2.0 * M_PI * QUAD_STAND_PITCH_HZ * tau);
+			torque[2] += QUAD_STAND_YAW_NM;
+		}
+	}
+
+	//Euler equations of the body
+	const double inertia[3] = {QUAD_INERTIA_X, QUAD_INERTIA_Y, QUAD_INERTIA_Z};
+	double *w = quad->rate;
+	double accel[3];
+	accel[0] = (torque[0] - (inertia[2] - inertia[1]) * w[1] * w[2]) / inertia[0];
+	accel[1] = (torque[1] - (inertia[0] - inertia[2]) * w[2] * w[0]) / inertia[1];
+	accel[2] = (torque[2] - (inertia[1] - inertia[0]) * w[0] * w[1]) / inertia[2];
+
+	//Translation : thrust along -z body, gravity, drag
+	double force = thrust[0] + thrust[1] + thrust[2] + thrust[3];
+	double linear[3];
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		linear[i] = (-r[i][2] * force - QUAD_DRAG * quad->velocity[i]) / QUAD_MASS;
+	}
+	linear[2] += QUAD_GRAVITY;
+
+	uint8_t grounded = (quad->position[2] >= 0) && (linear[2] >= 0);
+	if((quad->mode == QUAD_STAND) || grounded){
+		for(uint8_t i = 0 ; i < 3 ; i++){
+			linear[i] = 0;
+			quad->velocity[i] = 0;
+		}
+	}
+	if((quad->mode == QUAD_FREE) && grounded){
+		for(uint8_t i = 0 ; i < 3 ; i++){ //Lying on its legs
+			accel[i] = 0;
+			quad->rate[i] = 0;
+		}
+	}
+
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		quad->acceleration[i] = linear[i];
+		quad->velocity[i] += linear[i] * dt;
+		quad->position[i] += quad->velocity[i] * dt;
+		quad->rate[i] += accel[i] * dt;
+	}
+	if(quad->position[2] > 0){
+		quad->position[2] = 0;
+	}
+
+	//Quaternion derivative 0.5 * q * (0, rate), then normalization
+	double *q = quad->q;
+	double dq[4];
+	dq[0] = 0.5 * (-q[1] * w[0] - q[2] * w[1] - q[3] * w[2]);
+	dq[1] = 0.5 * (q[0] * w[0] + q[2] * w[2] - q[3] * w[1]);
+	dq[2] = 0.5 * (q[0] * w[1] - q[1] * w[2] + q[3] * w[0]);
+	dq[3] = 0.5 * (q[0] * w[2] + q[1] * w[1] - q[2] * w[0]);
+	double norm = 0;
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		q[i] += dq[i] * dt;
+		norm += q[i] * q[i];
+	}
+	norm = sqrt(norm);
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		q[i] /= norm;
+	}
+
+	quad->t += dt;
+}
+
+//Sensors values of the last step
+void hostQuadSensors(HostQuad *quad, HostMotion *motion){
+	double r[3][3];
+	hostQuadMatrix(quad, r);
+
+	//Gravity minus acceleration, in g, to body axes
+	double ned[3] = {-quad->acceleration[0] / QUAD_GRAVITY, -quad->acceleration[1] / QUAD_GRAVITY, 1.0 - quad->acceleration[2] / QUAD_GRAVITY};
+	double accel[3];
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		accel[i] = r[0][i] * ned[0] + r[1][i] * ned[1] + r[2][i] * ned[2];
+	}
+
+	double mag[3];
+	hostMotionMagnetic(r, mag);
+
+	hostMotionFromBody(quad->rate, accel, mag, motion);
+}
+
+#endif
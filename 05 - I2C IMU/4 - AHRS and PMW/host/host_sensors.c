@@ -0,0 +1,414 @@
+#include <math.h>
+#include <string.h>
+
+#include "host_sensors.h"
+
+//Common registers
+#define REG_WHO_AM_I 0x0F
+#define REG_CTRL0 0x1F //LSM303D
+#define REG_CTRL1 0x20
+#define REG_CTRL2 0x21
+#define REG_CTRL3 0x22
+#define REG_CTRL4 0x23
+#define REG_CTRL5 0x24
+#define REG_CTRL6 0x25 //LSM303D
+#define REG_CTRL7 0x26 //LSM303D
+#define REG_STATUS 0x27
+#define REG_OUT_X_L 0x28
+#define REG_OUT_Z_H 0x2D
+#define REG_FIFO_CTRL 0x2E
+#define REG_FIFO_SRC 0x2F
+#define REG_STATUS_M 0x07 //LSM303D
+#define REG_OUT_X_L_M 0x08 //LSM303D
+#define REG_OUT_Z_H_M 0x0D //LSM303D
+
+//FIFO_CTRL modes
+#define FIFO_BYPASS 0
+#define FIFO_FIFO 1
+#define FIFO_STREAM 2
+
+//*************************************
+//CONFIGURATION FROM THE REGISTERS
+//*************************************
+
+uint8_t hostImuFifoEnabled(HostImuChip *chip){
+	if(chip->type == HOST_L3G4200D){
+		return (chip->registers[REG_CTRL5] & (1<<6)) != 0;
+	}
+	return (chip->registers[REG_CTRL0] & (1<<6)) != 0;
+}
+
+uint8_t hostImuFifoMode(HostImuChip *chip){
+	if(!hostImuFifoEnabled(chip)){
+		return FIFO_BYPASS;
+	}
+	return chip->registers[REG_FIFO_CTRL] >> 5;
+}
+
+uint8_t hostImuFifoThreshold(HostImuChip *chip){
+	return chip->registers[REG_FIFO_CTRL] & 0x1F;
+}
+
+//Sample period of the gyro or accelerometer, 0 when powered down
+uint32_t hostImuMainPeriod(HostImuChip *chip){
+	uint8_t ctrl1 = chip->registers[REG_CTRL1];
+
+	if(chip->type == HOST_L3G4200D){
+		static const uint16_t rates[4] = {100, 200, 400, 800};
+		if(!(ctrl1 & (1<<3)) || !(ctrl1 & 0x07)){ //Power down or no axis
+			return 0;
+		}
+		return 1000000UL / rates[ctrl1 >> 6];
+	}
+
+	static const uint32_t periods[11] = {0, 320000, 160000, 80000, 40000, 20000, 10000, 5000, 2500, 1250, 625};
+	uint8_t aodr = ctrl1 >> 4;
+	if((aodr > 10) || !(ctrl1 & 0x07)){
+		return 0;
+	}
+	return periods[aodr];
+}
+
+//Sample period of the LSM303D magnetometer, 0 when powered down
+uint32_t hostImuMagPeriod(HostImuChip *chip){
+	static const uint32_t periods[6] = {320000, 160000, 80000, 40000, 20000, 10000};
+	uint8_t odr = (chip->registers[REG_CTRL5] >> 2) & 0x07;
+
+	if((chip->type != HOST_LSM303D) || (chip->registers[REG_CTRL7] & 0x03) || (odr > 5)){
+		return 0;
+	}
+	return periods[odr];
+}
+
+//Physical unit of one LSB of the gyro or accelerometer (dps or g)
+double hostImuMainSensitivity(HostImuChip *chip){
+	if(chip->type == HOST_L3G4200D){
+		static const double dps[4] = {0.00875, 0.0175, 0.070, 0.070};
+		return dps[(chip->registers[REG_CTRL4] >> 4) & 0x03];
+	}
+	static const double g[8] = {0.000061, 0.000122, 0.000183, 0.000244, 0.000732, 0.000732, 0.000732, 0.000732};
+	return g[(chip->registers[REG_CTRL2] >> 3) & 0x07];
+}
+
+//Gauss per LSB of the magnetometer
+double hostImuMagSensitivity(HostImuChip *chip){
+	static const double gauss[4] = {0.000080, 0.000160, 0.000320, 0.000479};
+	return gauss[(chip->registers[REG_CTRL6] >> 5) & 0x03];
+}
+
+//*************************************
+//SAMPLES
+//*************************************
+
+int16_t hostImuRaw(double value, double sensitivity){
+	double raw = round(value / sensitivity);
+	if(raw > 32767){
+		return 32767;
+	}
+	if(raw < -32768){
+		return -32768;
+	}
+	return (int16_t)raw;
+}
+
+void hostImuPush(HostImuChip *chip, HostSensorChannel *channel, int16_t sample[3], uint64_t us){
+	uint8_t mode = hostImuFifoMode(chip);
+
+	memcpy(channel->last, sample, sizeof(channel->last));
+	channel->lastUs = us;
+	channel->samples++;
+
+	if((channel != &chip->main) || (mode == FIFO_BYPASS)){
+		if(channel->dataReady){
+			channel->lost++;
+		}
+		channel->dataReady = 1;
+		return;
+	}
+
+	channel->dataReady = 1;
+	if(channel->fifoCount == HOST_FIFO_SIZE){
+		channel->overrun = 1;
+		channel->lost++;
+		if(mode == FIFO_FIFO){
+			return; //FIFO mode stops when full
+		}
+		channel->fifoHead = (channel->fifoHead + 1) % HOST_FIFO_SIZE; //Stream mode drops the oldest
+		channel->fifoCount--;
+	}
+
+	uint8_t tail = (channel->fifoHead + channel->fifoCount) % HOST_FIFO_SIZE;
+	memcpy(channel->fifo[tail], sample, sizeof(channel->fifo[tail]));
+	channel->fifoUs[tail] = us;
+	channel->fifoCount++;
+}
+
+//Level of DRDY/INT2 (L3G4200D) or INT1 (LSM303D)
+uint8_t hostImuInterruptLevel(HostImuChip *chip){
+	uint8_t ctrl3 = chip->registers[REG_CTRL3];
+	HostSensorChannel *channel = &chip->main;
+
+	if(chip->type == HOST_L3G4200D){
+		if((ctrl3 & (1<<3)) && channel->dataReady){ //I2_DRDY
+			return 1;
+		}
+		if((ctrl3 & (1<<2)) && hostImuFifoEnabled(chip) && (channel->fifoCount >= hostImuFifoThreshold(chip))){ //I2_WTM
+			return 1;
+		}
+		if((ctrl3 & (1<<1)) && channel->overrun){ //I2_ORun
+			return 1;
+		}
+		if((ctrl3 & (1<<0)) && hostImuFifoEnabled(chip) && (channel->fifoCount == 0)){ //I2_Empty
+			return 1;
+		}
+		return 0;
+	}
+
+	if((ctrl3 & (1<<2)) && channel->dataReady){ //INT1_DRDY_A
+		return 1;
+	}
+	if((ctrl3 & (1<<1)) && chip->mag.dataReady){ //INT1_DRDY_M
+		return 1;
+	}
+	if((ctrl3 & (1<<0)) && hostImuFifoEnabled(chip) && (channel->fifoCount == 0)){ //INT1_EMPTY
+		return 1;
+	}
+	return 0;
+}
+
+void hostImuUpdatePin(HostImuChip *chip){
+	if(chip->interruptPin != NULL){
+		hostSetPin(chip->interruptPin, chip->interruptBit, hostImuInterruptLevel(chip));
+	}
+}
+
+//Generate the samples due at this time
+void hostImuUpdate(HostTwiSlave *slave, uint64_t us){
+	HostImuChip *chip = (HostImuChip *)slave;
+	HostMotion motion;
+	int16_t sample[3];
+
+	while((chip->main.periodUs > 0) && (chip->main.nextUs <= us)){
+		chip->motion(chip->main.nextUs * 1e-6, &motion);
+		double sensitivity = hostImuMainSensitivity(chip);
+		for(uint8_t i = 0 ; i < 3 ; i++){
+			sample[i] = hostImuRaw((chip->type == HOST_L3G4200D) ? motion.gyro[i] : motion.accel[i], sensitivity);
+		}
+		hostImuPush(chip, &chip->main, sample, chip->main.nextUs);
+		chip->main.nextUs += chip->main.periodUs;
+	}
+
+	while((chip->mag.periodUs > 0) && (chip->mag.nextUs <= us)){
+		chip->motion(chip->mag.nextUs * 1e-6, &motion);
+		double sensitivity = hostImuMagSensitivity(chip);
+		for(uint8_t i = 0 ; i < 3 ; i++){
+			sample[i] = hostImuRaw(motion.mag[i], sensitivity);
+		}
+		hostImuPush(chip, &chip->mag, sample, chip->mag.nextUs);
+		chip->mag.nextUs += chip->mag.periodUs;
+	}
+
+	hostImuUpdatePin(chip);
+}
+
+uint64_t hostImuNextEvent(HostTwiSlave *slave){
+	HostImuChip *chip = (HostImuChip *)slave;
+	uint64_t next = UINT64_MAX / HOST_F_CPU; //Never, without overflow once in cycles
+
+	if((chip->main.periodUs > 0) && (chip->main.nextUs < next)){
+		next = chip->main.nextUs;
+	}
+	if((chip->mag.periodUs > 0) && (chip->mag.nextUs < next)){
+		next = chip->mag.nextUs;
+	}
+	return next;
+}
+
+//Output data rate changed : first sample one period from now
+void hostImuRestart(HostSensorChannel *channel, uint32_t periodUs){
+	if(periodUs != channel->periodUs){
+		channel->periodUs = periodUs;
+		channel->nextUs = hostMicros() + periodUs;
+	}
+}
+
+//*************************************
+//REGISTERS
+//*************************************
+
+//Sample of the output registers starting at this address
+uint8_t hostImuOutputByte(HostSensorChannel *channel, uint8_t offset){
+	uint16_t value = (uint16_t)channel->output[offset >> 1];
+	return (offset & 0x01) ? (value >> 8) : (value & 0xFF);
+}
+
+uint8_t hostImuReadRegister(HostImuChip *chip, uint8_t reg){
+	HostSensorChannel *channel = &chip->main;
+
+	if((reg >= REG_OUT_X_L) && (reg <= REG_OUT_Z_H)){
+		if(reg == REG_OUT_X_L){ //Latch the sample read (oldest FIFO sample, or the last one)
+			if((hostImuFifoMode(chip) != FIFO_BYPASS) && (channel->fifoCount > 0)){
+				memcpy(channel->output, channel->fifo[channel->fifoHead], sizeof(channel->output));
+				channel->outputUs = channel->fifoUs[channel->fifoHead];
+			}
+			else{
+				memcpy(channel->output, channel->last, sizeof(channel->output));
+				channel->outputUs = channel->lastUs;
+			}
+		}
+		uint8_t value = hostImuOutputByte(channel, reg - REG_OUT_X_L);
+		if(reg == REG_OUT_Z_H){ //Sample read
+			channel->dataReady = 0;
+			channel->readUs = channel->outputUs;
+			if((hostImuFifoMode(chip) != FIFO_BYPASS) && (channel->fifoCount > 0)){
+				channel->fifoHead = (channel->fifoHead + 1) % HOST_FIFO_SIZE;
+				channel->fifoCount--;
+				channel->overrun = 0;
+			}
+			hostImuUpdatePin(chip);
+		}
+		return value;
+	}
+
+	if((chip->type == HOST_LSM303D) && (reg >= REG_OUT_X_L_M) && (reg <= REG_OUT_Z_H_M)){
+		if(reg == REG_OUT_X_L_M){
+			memcpy(chip->mag.output, chip->mag.last, sizeof(chip->mag.output));
+			chip->mag.outputUs = chip->mag.lastUs;
+		}
+		uint8_t value = hostImuOutputByte(&chip->mag, reg - REG_OUT_X_L_M);
+		if(reg == REG_OUT_Z_H_M){
+			chip->mag.dataReady = 0;
+			chip->mag.readUs = chip->mag.outputUs;
+		}
+		return value;
+	}
+
+	switch(reg){
+		case REG_STATUS:
+			return channel->dataReady ? 0x0F : 0x00; //ZYXDA and each axis
+		case REG_STATUS_M:
+			return (chip->type == HOST_LSM303D) && chip->mag.dataReady ? 0x0F : 0x00;
+		case REG_FIFO_SRC: {
+			uint8_t src = (channel->fifoCount > 31) ? 31 : channel->fifoCount;
+			if(hostImuFifoEnabled(chip) && (channel->fifoCount >= hostImuFifoThreshold(chip))){
+				src |= 1<<7; //WTM (L3G4200D), FTH (LSM303D)
+			}
+			if(channel->overrun){
+				src |= 1<<6;
+			}
+			if(channel->fifoCount == 0){
+				src |= 1<<5;
+			}
+			return src;
+		}
+		default:
+			return chip->registers[reg];
+	}
+}
+
+void hostImuWriteRegister(HostImuChip *chip, uint8_t reg, uint8_t value){
+
+	if((reg == REG_WHO_AM_I) || (reg == REG_STATUS) || (reg == REG_FIFO_SRC) || ((reg >= REG_OUT_X_L) && (reg <= REG_OUT_Z_H))){
+		return; //Read only
+	}
+
+	chip->registers[reg] = value;
+
+	if((reg == REG_FIFO_CTRL) || (reg == REG_CTRL0) || (reg == REG_CTRL5)){
+		if(hostImuFifoMode(chip) == FIFO_BYPASS){ //Bypass mode empties the FIFO
+			chip->main.fifoCount = 0;
+			chip->main.fifoHead = 0;
+			chip->main.overrun = 0;
+		}
+	}
+
+	hostImuRestart(&chip->main, hostImuMainPeriod(chip));
+	hostImuRestart(&chip->mag, hostImuMagPeriod(chip));
+	hostImuUpdatePin(chip);
+}
+
+//Next register address, rolling back over the output registers in FIFO mode
+void hostImuNextRegister(HostImuChip *chip){
+	if(!chip->autoIncrement){
+		return;
+	}
+	chip->pointer = (chip->pointer + 1) & 0x7F;
+	if((chip->pointer == REG_OUT_Z_H + 1) && hostImuFifoEnabled(chip)){
+		chip->pointer = REG_OUT_X_L;
+	}
+}
+
+//*************************************
+//TWI SLAVE
+//*************************************
+
+void hostImuStart(HostTwiSlave *slave, uint8_t isRead){
+	HostImuChip *chip = (HostImuChip *)slave;
+	if(!isRead){
+		chip->registerPhase = 1;
+	}
+}
+
+uint8_t hostImuWrite(HostTwiSlave *slave, uint8_t data){
+	HostImuChip *chip = (HostImuChip *)slave;
+
+	if(chip->registerPhase){
+		chip->registerPhase = 0;
+		chip->pointer = data & 0x7F;
+		chip->autoIncrement = data >> 7;
+	}
+	else{
+		hostImuWriteRegister(chip, chip->pointer, data);
+		hostImuNextRegister(chip);
+	}
+	return 1;
+}
+
+uint8_t hostImuRead(HostTwiSlave *slave){
+	HostImuChip *chip = (HostImuChip *)slave;
+	uint8_t value = hostImuReadRegister(chip, chip->pointer);
+	hostImuNextRegister(chip);
+	return value;
+}
+
+void hostImuStop(HostTwiSlave *slave){
+	HostImuChip *chip = (HostImuChip *)slave;
+	chip->registerPhase = 0;
+}
+
+void hostImuInit(HostImuChip *chip, uint8_t type, uint8_t address, HostMotionSource motion){
+	memset(chip, 0, sizeof(HostImuChip));
+
+	chip->type = type;
+	chip->motion = motion;
+	chip->slave.address = address;
+	chip->slave.start = hostImuStart;
+	chip->slave.write = hostImuWrite;
+	chip->slave.read = hostImuRead;
+	chip->slave.stop = hostImuStop;
+	chip->slave.update = hostImuUpdate;
+	chip->slave.nextEvent = hostImuNextEvent;
+
+	hostTwiAttach(&chip->slave);
+}
+
+void hostL3g4200dInit(HostImuChip *chip, uint8_t address, HostMotionSource motion){
+	hostImuInit(chip, HOST_L3G4200D, address, motion);
+	chip->registers[REG_WHO_AM_I] = 0xD3;
+	chip->registers[REG_CTRL1] = 0x07; //Power down, all axis
+}
+
+void hostLsm303dInit(HostImuChip *chip, uint8_t address, HostMotionSource motion){
+	hostImuInit(chip, HOST_LSM303D, address, motion);
+	chip->registers[REG_WHO_AM_I] = 0x49;
+	chip->registers[REG_CTRL1] = 0x07; //Accelerometer power down, all axis
+	chip->registers[REG_CTRL5] = 0x18; //Magnetometer 6.25Hz
+	chip->registers[REG_CTRL6] = 0x20; //+-4 gauss
+	chip->registers[REG_CTRL7] = 0x02; //Magnetometer power down
+}
+
+void hostImuConnectInterrupt(HostImuChip *chip, volatile uint8_t *pin, uint8_t bit){
+	chip->interruptPin = pin;
+	chip->interruptBit = bit;
+	hostImuUpdatePin(chip);
+}
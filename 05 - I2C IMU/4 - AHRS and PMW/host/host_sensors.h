@@ -0,0 +1,78 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Register models of the Pololu MinIMU-9 v2 sensors, as TWI slaves of the
+//simulated MCU (host_avr.h) :
+//- L3G4200D gyro : CTRL1-5, output registers, FIFO (bypass, FIFO and stream
+//  modes, watermark), DRDY/INT2 (data ready or watermark).
+//- LSM303D accelerometer and magnetometer : CTRL0-7, accelerometer FIFO,
+//  magnetometer output registers, INT1 (accelerometer data ready).
+//Register addresses auto-increment when the MSB of the sub address is set,
+//in FIFO mode the output registers roll back from 0x2D to 0x28.
+//Samples come from a motion source, at the output data rate set in CTRL1
+//(CTRL5 for the magnetometer), with the full scale of CTRL4 (CTRL2, CTRL6).
+//*****************************************
+
+#ifndef HOST_SENSORS
+#define HOST_SENSORS
+
+#include <stdint.h>
+
+#include "host_avr.h"
+
+//Physical values seen by the sensors, in their own axes
+typedef struct {
+	double gyro[3]; //Degrees per second
+	double accel[3]; //g, gravity included
+	double mag[3]; //Gauss
+} HostMotion;
+
+//Values at t seconds
+typedef void (*HostMotionSource)(double t, HostMotion *motion);
+
+#define HOST_FIFO_SIZE 32
+
+//Output registers of one sensor and its FIFO
+typedef struct {
+	uint32_t periodUs; //0 : powered down
+	uint64_t nextUs; //Time of the next sample
+	int16_t last[3]; //Last sample
+	int16_t output[3]; //Sample being read (latched at the first output register)
+	int16_t fifo[HOST_FIFO_SIZE][3];
+	uint64_t lastUs; //Time of each sample
+	uint64_t outputUs;
+	uint64_t fifoUs[HOST_FIFO_SIZE];
+	uint64_t readUs; //Time of the last sample completely read (up to its Z high byte)
+	uint8_t fifoHead;
+	uint8_t fifoCount;
+	uint8_t overrun;
+	uint8_t dataReady; //New sample not read yet
+	uint32_t samples; //Generated samples
+	uint32_t lost; //Samples overwritten (or not stored by a full FIFO) before being read
+} HostSensorChannel;
+
+#define HOST_L3G4200D 0
+#define HOST_LSM303D 1
+
+typedef struct {
+	HostTwiSlave slave; //First : a HostTwiSlave pointer is a HostImuChip pointer
+	uint8_t type; //HOST_L3G4200D or HOST_LSM303D
+	uint8_t registers[0x80];
+	uint8_t pointer; //Register address
+	uint8_t autoIncrement;
+	uint8_t registerPhase; //The next written byte is the register address
+	HostSensorChannel main; //Gyro or accelerometer
+	HostSensorChannel mag; //LSM303D magnetometer
+	HostMotionSource motion;
+	volatile uint8_t *interruptPin; //DRDY/INT2 or INT1, can be NULL
+	uint8_t interruptBit;
+} HostImuChip;
+
+//Reset the chip registers and attach it to the simulated TWI bus
+void hostL3g4200dInit(HostImuChip *chip, uint8_t address, HostMotionSource motion);
+void hostLsm303dInit(HostImuChip *chip, uint8_t address, HostMotionSource motion);
+
+//Drive this input pin with DRDY/INT2 (L3G4200D) or INT1 (LSM303D)
+void hostImuConnectInterrupt(HostImuChip *chip, volatile uint8_t *pin, uint8_t bit);
+
+#endif
@@ -0,0 +1,269 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Software in the loop : main.c as is (same unity build as flight_sim.c) drives
+//the quadcopter model of host_quad.h, which moves the simulated sensors.
+//The motor pins (PD1 to PD4) are timed after each interrupt and main loop pass,
+//each pulse width goes to its ESC. The body moves by QUAD_STEP_US steps.
+//Measured :
+//- attitude error while the AHRS runs (0.5s after its start),
+//- loop : interval between two DCM updates,
+//- PMW period : interval between two rising edges of PD1,
+//- latency : from the last gyro sample used by a DCM update to the next
+//  rising edge of the motor pins (first pulse sent with the new servo[]),
+//- command : from the DCM update (new servo[]) to that rising edge.
+//Edges are timed at the end of the interrupt that made them (a few us late).
+//
+//Usage : quad_sim [-t seconds] [-m stand|free] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]
+//Prints the estimated and true angles, the pulse widths and the altitude every -p ms
+//(0 : none) on stdout, the measures and statistics on stderr.
+//*****************************************
+
+#include <time.h>
+
+#define main flightMain
+#include "../main.c"
+#undef main
+
+#include "host_sensors.h"
+#include "host_motion.h"
+#include "host_quad.h"
+
+#define QUAD_STEP_US 1000 //Body model step
+#define SIM_ERROR_US 10000 //Errors sampled every 10ms
+#define SIM_SETTLE_US 500000 //Errors counted 0.5s after the AHRS start
+
+HostImuChip gyroChip;
+HostImuChip accelChip;
+HostQuad simQuad;
+
+uint64_t simEndUs;
+uint32_t simPrintMs = 100;
+uint64_t simNextPrintUs = 0;
+uint64_t simNextErrorUs = 0;
+uint64_t simAhrsStartUs = 0;
+uint64_t simNextStepUs = 0;
+HostAttitudeErrors simErrors;
+clock_t simWallStart;
+
+//Motor pins
+uint8_t simPins = 0;
+double simRiseUs[4];
+double simPulseUs[4]; //Last width, standard PMW microseconds
+
+//Intervals statistics (microseconds)
+typedef struct {
+	double last;
+	double sum;
+	double squares;
+	double min;
+	double max;
+	uint32_t count;
+} SimInterval;
+
+SimInterval simLoop;
+SimInterval simPeriod;
+SimInterval simLatency;
+SimInterval simCommand;
+
+uint32_t simIteration = 0; //Last DCM iteration seen
+double simSampleUs = -1; //Gyro sample of the last DCM update, -1 once sent
+double simUpdateUs = -1; //Time of the last DCM update, -1 once sent
+
+void simValue(SimInterval *interval, double value){
+	if((interval->count == 0) || (value < interval->min)){
+		interval->min = value;
+	}
+	if((interval->count == 0) || (value > interval->max)){
+		interval->max = value;
+	}
+	interval->sum += value;
+	interval->squares += value * value;
+	interval->count++;
+}
+
+//Interval since the previous event (none before the first one)
+void simEvent(SimInterval *interval, double us){
+	if(interval->last > 0){
+		simValue(interval, us - interval->last);
+	}
+	interval->last = us;
+}
+
+void simReport(const char *name, SimInterval *interval){
+	if(interval->count == 0){
+		fprintf(stderr, "%-10s none\n", name);
+		return;
+	}
+	double mean = interval->sum / interval->count;
+	double deviation = sqrt(fmax(0.0, interval->squares / interval->count - mean * mean));
+	fprintf(stderr, "%-10s mean %.0fus, deviation %.1fus, min %.0fus, max %.0fus (%u)\n",
+		name, mean, deviation, interval->min, interval->max, interval->count);
+}
+
+//The quadcopter seen by the sensors
+void simQuadMotion(double t, HostMotion *motion){
+	hostQuadSensors(&simQuad, motion);
+}
+
+//Body model up to now
+void simAdvance(){
+	while(hostMicros() >= simNextStepUs){
+		hostQuadStep(&simQuad, QUAD_STEP_US * 1e-6);
+		simNextStepUs += QUAD_STEP_US;
+	}
+}
+
+//DCM update since the last check
+void simUpdateCheck(double now){
+	if(ahrsIteration != simIteration){
+		simIteration = ahrsIteration;
+		simEvent(&simLoop, now);
+		simSampleUs = gyroChip.main.readUs; //The next pulse carries the last update
+		simUpdateUs = now;
+	}
+}
+
+//Motor pins edges (pmwTrigger() sets them from the main loop, the update is checked first)
+void simPinsCheck(){
+	uint8_t pins = PORTD & MOTORS_PINS;
+	uint8_t changed = pins ^ simPins;
+	double now = (double)hostCycles / (HOST_F_CPU / 1000000UL);
+
+	if(changed == 0){
+		return;
+	}
+	simPins = pins;
+
+	simAdvance();
+	simUpdateCheck(now);
+
+	if(changed & pins){ //A pulse starts
+		if(changed & pins & (1<<PORTD1)){
+			simEvent(&simPeriod, now);
+		}
+		if(simSampleUs >= 0){
+			simValue(&simLatency, now - simSampleUs);
+			simSampleUs = -1;
+		}
+		if(simUpdateUs >= 0){
+			simValue(&simCommand, now - simUpdateUs);
+			simUpdateUs = -1;
+		}
+	}
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		uint8_t pin = 1<<(i + 1);
+		if(changed & pins & pin){
+			simRiseUs[i] = now;
+		}
+		else if(changed & pin){ //Pulse end
+			simPulseUs[i] = (now - simRiseUs[i]) * PMW_TICKS_PER_US;
+			hostQuadEsc(&simQuad, i, simPulseUs[i]);
+		}
+	}
+}
+
+//After each interrupt vector
+void simInterrupt(){
+	simPinsCheck();
+	simAdvance();
+}
+
+//End of each main loop pass
+void simIdle(){
+
+	uint64_t now = hostMicros();
+	double truth[3];
+
+	simUpdateCheck(now);
+	AhrsEuler();
+	double estimate[3] = {ToDeg(roll), ToDeg(pitch), ToDeg(yaw)};
+	simPinsCheck();
+	simAdvance();
+	hostQuadAngles(&simQuad, truth);
+
+	if((simPrintMs > 0) && (now >= simNextPrintUs)){
+		simNextPrintUs = (now / (simPrintMs * 1000UL) + 1) * simPrintMs * 1000UL;
+		printf("%.3f,%u,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.0f,%.0f,%.0f,%.0f,%.3f\n", now * 1e-6, ahrsRunning,
+			estimate[0], estimate[1], estimate[2], truth[0], truth[1], truth[2],
+			simPulseUs[0], simPulseUs[1], simPulseUs[2], simPulseUs[3], -simQuad.position[2]);
+	}
+
+	if(!ahrsRunning){
+		simAhrsStartUs = 0;
+	}
+	else if(simAhrsStartUs == 0){
+		simAhrsStartUs = now;
+		simNextErrorUs = now + SIM_SETTLE_US;
+	}
+	else if(now >= simNextErrorUs){
+		simNextErrorUs += SIM_ERROR_US;
+		hostAttitudeError(&simErrors, estimate, truth);
+	}
+
+	if(now >= simEndUs){
+		double wallSeconds = (double)(clock() - simWallStart) / CLOCKS_PER_SEC;
+		hostRunReport(&gyroChip, &accelChip, now * 1e-6, wallSeconds);
+		hostAttitudeReport(&simErrors);
+		simReport("Loop", &simLoop);
+		simReport("PMW period", &simPeriod);
+		simReport("Latency", &simLatency);
+		simReport("Command", &simCommand);
+		exit(0);
+	}
+}
+
+int main(int argc, char *argv[]){
+
+	double duration = 16; //Motors sequence of main.c : AHRS from 7 to 15s
+	uint8_t mode = QUAD_STAND;
+
+	hostMotionStart = 8.0; //Stand disturbances once the AHRS runs
+
+	for(int i = 1 ; i + 1 < argc ; i += 2){
+		if(!strcmp(argv[i], "-t")){
+			duration = atof(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-m") && !strcmp(argv[i + 1], "stand")){
+			mode = QUAD_STAND;
+		}
+		else if(!strcmp(argv[i], "-m") && !strcmp(argv[i + 1], "free")){
+			mode = QUAD_FREE;
+		}
+		else if(!strcmp(argv[i], "-p")){
+			simPrintMs = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-n")){
+			hostTwiNackEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-h")){
+			hostTwiHangEvery = atoi(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-s")){
+			hostMotionSeed = atoi(argv[i + 1]);
+		}
+		else{
+			fprintf(stderr, "Usage: %s [-t seconds] [-m stand|free] [-p ms] [-n nackEvery] [-h hangEvery] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	hostQuadInit(&simQuad, mode);
+	hostL3g4200dInit(&gyroChip, gyroAdd, simQuadMotion);
+	hostLsm303dInit(&accelChip, accelAdd, simQuadMotion);
+#if AHRS_DATA_READY == 1
+	hostImuConnectInterrupt(&gyroChip, &PINB, GYRO_DRDY_PIN);
+	hostImuConnectInterrupt(&accelChip, &PINB, ACCEL_DRDY_PIN);
+#endif
+
+	if(simPrintMs > 0){
+		printf("t,ahrs,roll,pitch,yaw,true_roll,true_pitch,true_yaw,pulse0,pulse1,pulse2,pulse3,altitude\n");
+	}
+
+	simEndUs = (uint64_t)(duration * 1e6);
+	simWallStart = clock();
+	hostInterruptHook = simInterrupt;
+	hostIdleHook = simIdle;
+
+	return flightMain();
+}
@@ -0,0 +1,530 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Cycles of the ISRs and of some functions of a firmware image, run by simavr
+//with the L3G4200D and LSM303D models (host_sensors.c) on its TWI bus
+//(gyro DRDY/INT2 on PB0, accelerometer INT1 on PB1).
+//The board lies still and level : gyro noise and bias, 1g on Z, a fixed
+//magnetic field (sensors axes and signs of monni_ahrs.h).
+//With -r, an RC receiver drives port B instead of the sensors (RC Control image):
+//-r pwm : one pulse per channel on PB1 to PB4, one channel after the other, every 20ms.
+//-r ppm : PPM sum signal on PB0 (ICP1), 8 channels, 300us low separators, 22.5ms frames.
+//The sticks move : 1100 to 1900us.
+//
+//Usage : simavr_bench [-t seconds] [-m mcu] [-F hz] [-r pwm|ppm] [-f function]... firmware.elf firmware.sym
+//firmware.sym is the output of avr-nm. Every ISR (__vector_N) is measured,
+//and each function given with -f.
+//Writes JSON on stdout : calls, min, avg, max and total cycles of each one.
+//An ISR is measured from its first instruction to its RETI (the 4 cycles
+//response and the JMP of the vector table are not counted), a function from
+//its first instruction to its RET, without the ISRs that ran meanwhile.
+//A function not called (inlined by the compiler) is reported with 0 calls.
+//*****************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_twi.h"
+#include "avr_ioport.h"
+
+#include "host_sensors.h"
+
+#define BENCH_MAX_PROBES 64
+#define BENCH_FLASH_WORDS 0x4000 //ATmega328p : 32KB
+#define BENCH_GYRO_ADDRESS 0b1101011
+#define BENCH_ACCEL_ADDRESS 0b0011101
+
+//Vector names of the ATmega328p, __vector_1 to __vector_25
+const char *benchVectorNames[26] = {"RESET", "INT0", "INT1", "PCINT0", "PCINT1", "PCINT2", "WDT",
+	"TIMER2_COMPA", "TIMER2_COMPB", "TIMER2_OVF", "TIMER1_CAPT", "TIMER1_COMPA", "TIMER1_COMPB",
+	"TIMER1_OVF", "TIMER0_COMPA", "TIMER0_COMPB", "TIMER0_OVF", "SPI_STC", "USART_RX", "USART_UDRE",
+	"USART_TX", "ADC", "EE_READY", "ANALOG_COMP", "TWI", "SPM_READY"};
+
+typedef struct {
+	char name[64];
+	char symbol[64];
+	uint32_t address; //Bytes
+	uint8_t isVector;
+	uint32_t calls;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	//Running call
+	uint8_t active;
+	uint16_t entrySp;
+	uint64_t entryCycle;
+	uint64_t entryIsrCycles;
+} BenchProbe;
+
+BenchProbe benchProbes[BENCH_MAX_PROBES];
+uint8_t benchNbProbes = 0;
+uint8_t benchProbeAt[BENCH_FLASH_WORDS]; //Probe number + 1 at each flash word, 0 : none
+uint64_t benchIsrCycles = 0; //Cycles spent in the ISRs so far
+
+avr_t *avr;
+avr_irq_t *benchTwiIrq;
+volatile uint8_t benchPinB = 0; //Levels driven by the sensors on port B
+HostTwiSlave *benchSlaves = NULL;
+HostTwiSlave *benchSelected = NULL;
+uint32_t benchSeed = 1;
+
+//RC receiver (-r)
+#define BENCH_RC_NONE 0
+#define BENCH_RC_PWM 1
+#define BENCH_RC_PPM 2
+#define BENCH_RC_PWM_FRAME_US 20000
+#define BENCH_RC_PPM_FRAME_US 22500
+#define BENCH_RC_PPM_CHANNELS 8
+#define BENCH_RC_PPM_SEPARATOR_US 300
+
+typedef struct {
+	uint64_t us;
+	uint8_t bit; //Port B
+	uint8_t level;
+} BenchEdge;
+
+uint8_t benchRc = BENCH_RC_NONE;
+BenchEdge benchRcEdges[2 * BENCH_RC_PPM_CHANNELS + 2]; //Edges of the current frame
+uint8_t benchRcNbEdges = 0;
+uint8_t benchRcNext = 0;
+uint64_t benchRcFrameUs = 0; //Start of the next frame
+
+//*************************************
+//HOST_AVR.H FUNCTIONS USED BY THE SENSORS MODELS
+//*************************************
+
+uint64_t hostMicros(){
+	return avr->cycle / (avr->frequency / 1000000UL);
+}
+
+void hostSetPin(volatile uint8_t *pin, uint8_t bit, uint8_t level){
+	uint8_t old = *pin;
+
+	if(level){
+		*pin |= 1<<bit;
+	}
+	else{
+		*pin &= ~(1<<bit);
+	}
+
+	if((pin == &benchPinB) && (old != *pin)){
+		avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), bit), level);
+	}
+}
+
+void hostTwiAttach(HostTwiSlave *slave){
+	slave->next = benchSlaves;
+	benchSlaves = slave;
+}
+
+//*************************************
+//SENSORS
+//*************************************
+
+double benchNoise(double sigma){
+	double u[2];
+	for(uint8_t i = 0 ; i < 2 ; i++){
+		benchSeed = benchSeed * 1103515245UL + 12345UL;
+		u[i] = ((benchSeed >> 8) + 1.0) / 16777217.0;
+	}
+	return sigma * sqrt(-2.0 * log(u[0])) * cos(2.0 * M_PI * u[1]);
+}
+
+void benchMotion(double t, HostMotion *motion){
+	const double accel[3] = {0, 0, -1}; //ACCEL_SIGN_Z is -1
+	const double mag[3] = {0.20, -0.05, -0.35};
+
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		motion->gyro[i] = 0.5 + benchNoise(0.3);
+		motion->accel[i] = accel[i] + benchNoise(0.003);
+		motion->mag[i] = mag[i] + benchNoise(0.002);
+	}
+}
+
+void benchUpdateSensors(){
+	for(HostTwiSlave *slave = benchSlaves ; slave != NULL ; slave = slave->next){
+		slave->update(slave, hostMicros());
+	}
+}
+
+//Cycle of the next sample
+uint64_t benchNextSensorsEvent(){
+	uint64_t next = UINT64_MAX;
+	for(HostTwiSlave *slave = benchSlaves ; slave != NULL ; slave = slave->next){
+		uint64_t event = slave->nextEvent(slave) * (avr->frequency / 1000000UL);
+		if(event < next){
+			next = event;
+		}
+	}
+	return next;
+}
+
+//TWI master output of simavr : START with SLA+R/W, bytes written or read, STOP
+void benchTwiHook(struct avr_irq_t *irq, uint32_t value, void *param){
+	avr_twi_msg_irq_t message;
+	message.u.v = value;
+
+	benchUpdateSensors();
+
+	if(message.u.twi.msg & TWI_COND_STOP){
+		if(benchSelected != NULL){
+			benchSelected->stop(benchSelected);
+		}
+		benchSelected = NULL;
+	}
+
+	if(message.u.twi.msg & TWI_COND_START){
+		HostTwiSlave *slave = benchSlaves;
+		while((slave != NULL) && (slave->address != (message.u.twi.addr >> 1))){
+			slave = slave->next;
+		}
+		if((benchSelected != NULL) && (benchSelected != slave)){
+			benchSelected->stop(benchSelected);
+		}
+		benchSelected = slave;
+		if(slave != NULL){
+			slave->start(slave, message.u.twi.addr & 0x01);
+			avr_raise_irq(benchTwiIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, message.u.twi.addr, 1));
+		}
+	}
+
+	if(benchSelected == NULL){
+		return;
+	}
+
+	if(message.u.twi.msg & TWI_COND_WRITE){
+		uint8_t ack = benchSelected->write(benchSelected, message.u.twi.data);
+		avr_raise_irq(benchTwiIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_ACK, message.u.twi.addr, ack));
+	}
+
+	if(message.u.twi.msg & TWI_COND_READ){
+		uint8_t data = benchSelected->read(benchSelected);
+		avr_raise_irq(benchTwiIrq + TWI_IRQ_INPUT, avr_twi_irq_msg(TWI_COND_READ, message.u.twi.addr, data));
+	}
+}
+
+void benchConnectTwi(){
+	static const char *names[2] = {"twi.in", "twi.out"};
+
+	benchTwiIrq = avr_alloc_irq(&avr->irq_pool, 0, 2, names);
+	avr_connect_irq(benchTwiIrq + TWI_IRQ_INPUT, avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT));
+	avr_connect_irq(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), benchTwiIrq + TWI_IRQ_OUTPUT);
+	avr_irq_register_notify(benchTwiIrq + TWI_IRQ_OUTPUT, benchTwiHook, NULL);
+}
+
+//*************************************
+//RC RECEIVER
+//*************************************
+
+uint16_t benchRcChannelUs(uint8_t channel, double t){
+	return 1500 + 400 * sin(2.0 * M_PI * (0.5 + 0.25 * channel) * t);
+}
+
+void benchRcAddEdge(uint64_t us, uint8_t bit, uint8_t level){
+	benchRcEdges[benchRcNbEdges].us = us;
+	benchRcEdges[benchRcNbEdges].bit = bit;
+	benchRcEdges[benchRcNbEdges].level = level;
+	benchRcNbEdges++;
+}
+
+//Edges of the frame starting at benchRcFrameUs
+void benchRcFrame(){
+	uint64_t us = benchRcFrameUs;
+	double t = us * 1e-6;
+
+	benchRcNbEdges = 0;
+	benchRcNext = 0;
+
+	if(benchRc == BENCH_RC_PWM){
+		for(uint8_t i = 0 ; i < 4 ; i++){
+			benchRcAddEdge(us, i + 1, 1);
+			us += benchRcChannelUs(i, t);
+			benchRcAddEdge(us, i + 1, 0);
+		}
+		benchRcFrameUs += BENCH_RC_PWM_FRAME_US;
+	}
+	else{
+		//A rising edge at the end of each separator, the channel is the time between two rising edges
+		for(uint8_t i = 0 ; i <= BENCH_RC_PPM_CHANNELS ; i++){
+			benchRcAddEdge(us, 0, 0);
+			benchRcAddEdge(us + BENCH_RC_PPM_SEPARATOR_US, 0, 1);
+			if(i < BENCH_RC_PPM_CHANNELS){
+				us += benchRcChannelUs(i, t);
+			}
+		}
+		benchRcFrameUs += BENCH_RC_PPM_FRAME_US;
+	}
+}
+
+//Edges due at this time
+void benchUpdateRc(){
+	uint64_t now = hostMicros();
+
+	while(1){
+		if(benchRcNext == benchRcNbEdges){
+			benchRcFrame();
+		}
+		BenchEdge *edge = &benchRcEdges[benchRcNext];
+		if(edge->us > now){
+			return;
+		}
+		hostSetPin(&benchPinB, edge->bit, edge->level);
+		benchRcNext++;
+	}
+}
+
+//Cycle of the next edge
+uint64_t benchNextRcEvent(){
+	if(benchRcNext == benchRcNbEdges){
+		return benchRcFrameUs * (avr->frequency / 1000000UL);
+	}
+	return benchRcEdges[benchRcNext].us * (avr->frequency / 1000000UL);
+}
+
+//*************************************
+//PROBES
+//*************************************
+
+BenchProbe *benchAddProbe(const char *name, const char *symbol, uint8_t isVector){
+	if(benchNbProbes == BENCH_MAX_PROBES){
+		fprintf(stderr, "Too many probes, %s ignored\n", name);
+		return NULL;
+	}
+	BenchProbe *probe = &benchProbes[benchNbProbes++];
+	memset(probe, 0, sizeof(BenchProbe));
+	snprintf(probe->name, sizeof(probe->name), "%s", name);
+	snprintf(probe->symbol, sizeof(probe->symbol), "%s", symbol);
+	probe->isVector = isVector;
+	probe->min = UINT64_MAX;
+	return probe;
+}
+
+//Addresses of the probes from the avr-nm output, every __vector_N becomes a probe
+uint8_t benchLoadSymbols(const char *fileName){
+	FILE *file = fopen(fileName, "r");
+	if(file == NULL){
+		perror(fileName);
+		return 0;
+	}
+
+	char line[256];
+	while(fgets(line, sizeof(line), file) != NULL){
+		unsigned int address;
+		char type;
+		char symbol[128];
+		if(sscanf(line, "%x %c %127s", &address, &type, symbol) != 3){
+			continue;
+		}
+		if((type != 'T') && (type != 't')){
+			continue; //Not in .text
+		}
+
+		int vector;
+		BenchProbe *probe = NULL;
+		if((sscanf(symbol, "__vector_%d", &vector) == 1) && (vector > 0) && (vector < 26)){
+			char name[64];
+			snprintf(name, sizeof(name), "%s_vect", benchVectorNames[vector]);
+			probe = benchAddProbe(name, symbol, 1);
+		}
+		else{
+			for(uint8_t i = 0 ; i < benchNbProbes ; i++){
+				if(!benchProbes[i].isVector && !strcmp(benchProbes[i].symbol, symbol)){
+					probe = &benchProbes[i];
+				}
+			}
+		}
+
+		if((probe != NULL) && (address / 2 < BENCH_FLASH_WORDS)){
+			probe->address = address;
+			benchProbeAt[address / 2] = (probe - benchProbes) + 1;
+		}
+	}
+	fclose(file);
+	return 1;
+}
+
+uint16_t benchSp(){
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+//Returns of the running probes (the stack is back above its entry level), then entry in a probe
+void benchCheckProbes(){
+	uint16_t sp = benchSp();
+
+	for(uint8_t i = 0 ; i < benchNbProbes ; i++){
+		BenchProbe *probe = &benchProbes[i];
+		if(!probe->active || (sp <= probe->entrySp)){
+			continue;
+		}
+		probe->active = 0;
+		uint64_t cycles = avr->cycle - probe->entryCycle;
+		if(probe->isVector){
+			benchIsrCycles += cycles;
+		}
+		else{
+			cycles -= benchIsrCycles - probe->entryIsrCycles;
+		}
+		probe->calls++;
+		probe->total += cycles;
+		if(cycles < probe->min){
+			probe->min = cycles;
+		}
+		if(cycles > probe->max){
+			probe->max = cycles;
+		}
+	}
+
+	uint32_t word = avr->pc / 2;
+	if((word < BENCH_FLASH_WORDS) && benchProbeAt[word]){
+		BenchProbe *probe = &benchProbes[benchProbeAt[word] - 1];
+		if(!probe->active){ //A call nested in the running one (from an ISR) is not measured
+			probe->active = 1;
+			probe->entrySp = sp;
+			probe->entryCycle = avr->cycle;
+			probe->entryIsrCycles = benchIsrCycles;
+		}
+	}
+}
+
+void benchWriteJson(const char *firmware){
+	printf("{\n");
+	printf("  \"firmware\": \"%s\",\n", firmware);
+	printf("  \"mcu\": \"%s\",\n", avr->mmcu);
+	printf("  \"f_cpu\": %u,\n", avr->frequency);
+	printf("  \"cycles\": %llu,\n", (unsigned long long)avr->cycle);
+	printf("  \"probes\": [\n");
+	for(uint8_t i = 0 ; i < benchNbProbes ; i++){
+		BenchProbe *probe = &benchProbes[i];
+		printf("    {\"name\": \"%s\", \"symbol\": \"%s\", \"type\": \"%s\", \"address\": %u, \"calls\": %u, ",
+			probe->name, probe->symbol, probe->isVector ? "isr" : "function", probe->address, probe->calls);
+		if(probe->calls > 0){
+			printf("\"min\": %llu, \"avg\": %.1f, \"max\": %llu, \"total\": %llu}",
+				(unsigned long long)probe->min, (double)probe->total / probe->calls,
+				(unsigned long long)probe->max, (unsigned long long)probe->total);
+		}
+		else{
+			printf("\"min\": 0, \"avg\": 0, \"max\": 0, \"total\": 0}");
+		}
+		printf("%s\n", (i + 1 < benchNbProbes) ? "," : "");
+	}
+	printf("  ]\n");
+	printf("}\n");
+}
+
+//*************************************
+//MAIN
+//*************************************
+
+int main(int argc, char *argv[]){
+
+	double duration = 16;
+	const char *mcu = "atmega328p";
+	uint32_t frequency = 8000000;
+	const char *firmwareFile = NULL;
+	const char *symbolsFile = NULL;
+
+	for(int i = 1 ; i < argc ; i++){
+		if(!strcmp(argv[i], "-t") && (i + 1 < argc)){
+			duration = atof(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-m") && (i + 1 < argc)){
+			mcu = argv[++i];
+		}
+		else if(!strcmp(argv[i], "-F") && (i + 1 < argc)){
+			frequency = atol(argv[++i]);
+		}
+		else if(!strcmp(argv[i], "-r") && (i + 1 < argc) && !strcmp(argv[i + 1], "pwm")){
+			benchRc = BENCH_RC_PWM;
+			i++;
+		}
+		else if(!strcmp(argv[i], "-r") && (i + 1 < argc) && !strcmp(argv[i + 1], "ppm")){
+			benchRc = BENCH_RC_PPM;
+			i++;
+		}
+		else if(!strcmp(argv[i], "-f") && (i + 1 < argc)){
+			benchAddProbe(argv[i + 1], argv[i + 1], 0);
+			i++;
+		}
+		else if(firmwareFile == NULL){
+			firmwareFile = argv[i];
+		}
+		else{
+			symbolsFile = argv[i];
+		}
+	}
+
+	if((firmwareFile == NULL) || (symbolsFile == NULL)){
+		fprintf(stderr, "Usage: %s [-t seconds] [-m mcu] [-F hz] [-r pwm|ppm] [-f function]... firmware.elf firmware.sym\n", argv[0]);
+		return 1;
+	}
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if(elf_read_firmware(firmwareFile, &firmware) != 0){
+		fprintf(stderr, "%s: cannot be read\n", firmwareFile);
+		return 1;
+	}
+	if(firmware.mmcu[0] == 0){
+		snprintf(firmware.mmcu, sizeof(firmware.mmcu), "%s", mcu);
+	}
+
+	avr = avr_make_mcu_by_name(firmware.mmcu);
+	if(avr == NULL){
+		fprintf(stderr, "%s: unknown MCU\n", firmware.mmcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	if(avr->frequency == 0){
+		avr->frequency = frequency;
+	}
+
+	if(!benchLoadSymbols(symbolsFile)){
+		return 1;
+	}
+
+	//Pololu MinIMU-9 v2, or the RC receiver
+	HostImuChip gyroChip;
+	HostImuChip accelChip;
+	if(benchRc == BENCH_RC_NONE){
+		hostL3g4200dInit(&gyroChip, BENCH_GYRO_ADDRESS, benchMotion);
+		hostLsm303dInit(&accelChip, BENCH_ACCEL_ADDRESS, benchMotion);
+		hostImuConnectInterrupt(&gyroChip, &benchPinB, 0);
+		hostImuConnectInterrupt(&accelChip, &benchPinB, 1);
+		benchConnectTwi();
+	}
+	else if(benchRc == BENCH_RC_PPM){
+		hostSetPin(&benchPinB, 0, 1); //PPM line idles high
+	}
+
+	uint64_t endCycle = (uint64_t)(duration * avr->frequency);
+	uint64_t sensorsEvent = 0;
+	uint64_t rcEvent = 0;
+	int state = cpu_Running;
+
+	while((avr->cycle < endCycle) && (state != cpu_Done) && (state != cpu_Crashed)){
+		state = avr_run(avr);
+		if((benchRc == BENCH_RC_NONE) && (avr->cycle >= sensorsEvent)){
+			benchUpdateSensors();
+			sensorsEvent = benchNextSensorsEvent();
+		}
+		if((benchRc != BENCH_RC_NONE) && (avr->cycle >= rcEvent)){
+			benchUpdateRc();
+			rcEvent = benchNextRcEvent();
+		}
+		benchCheckProbes();
+	}
+
+	if(state == cpu_Crashed){
+		fprintf(stderr, "%s crashed at pc 0x%x\n", firmwareFile, avr->pc);
+	}
+
+	benchWriteJson(firmwareFile);
+
+	return (state == cpu_Crashed) ? 1 : 0;
+}
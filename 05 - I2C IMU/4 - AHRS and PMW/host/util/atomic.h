@@ -0,0 +1,22 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <util/atomic.h>.
+//The interrupt flag is restored when the block is left, even by a return.
+//*****************************************
+
+#ifndef HOST_UTIL_ATOMIC
+#define HOST_UTIL_ATOMIC
+
+#include "host_avr.h"
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+
+static inline void hostAtomicExit(uint8_t *interrupts){
+	hostRestoreInterrupts(*interrupts);
+}
+
+#define ATOMIC_BLOCK(type) for(uint8_t hostAtomicState __attribute__((cleanup(hostAtomicExit))) = hostSaveInterrupts() | (type), hostAtomicOnce = 1 ; hostAtomicOnce ; hostAtomicOnce = 0)
+
+#endif
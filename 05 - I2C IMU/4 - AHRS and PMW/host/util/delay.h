@@ -0,0 +1,20 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Host replacement of <util/delay.h> : the delays run the simulated MCU.
+//*****************************************
+
+#ifndef HOST_UTIL_DELAY
+#define HOST_UTIL_DELAY
+
+#include "host_avr.h"
+
+static inline void _delay_us(double us){
+	hostRunCycles((uint64_t)(us * (HOST_F_CPU / 1000000UL)));
+}
+
+static inline void _delay_ms(double ms){
+	hostRunCycles((uint64_t)(ms * (HOST_F_CPU / 1000UL)));
+}
+
+#endif
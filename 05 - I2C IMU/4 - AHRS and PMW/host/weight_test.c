@@ -0,0 +1,93 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Accelerometer weight of Drift_correction() (monni_ahrs.h): the ACCEL_WEIGHT table
+//against the exact curve 1 - 2*|1 - |a|/g| (0 below 0.5g and above 1.5g).
+//Every integer squared magnitude up to (2g)^2 is checked, then one value out of 997
+//up to the largest one (3 axes at -32768). The table must stay within
+//WEIGHT_MAX_ERROR of full weight, be 1 at 1g and 0 out of the band.
+//Accel_weight_q15() is checked on the same sweep along an axis and a diagonal.
+//
+//Usage : weight_test
+//Prints the largest error and where it is, returns 1 if a check fails.
+//*****************************************
+
+#define F_CPU 8000000UL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "monni_hal.h"
+#include "monni_i2c.h"
+#include "monni_clock.h"
+#include "monni_scheduler.h"
+
+volatile uint16_t servo[4] = {700, 700, 700, 700}; //Written by Ahrs_calculations()
+
+#include "monni_ahrs.h"
+
+#define WEIGHT_MAX_ERROR 0.006 //Of full weight (the monni_ahrs.h comment says 0.6%)
+
+//Exact weight of a squared magnitude (raw units), 0 to 1
+double exactWeight(double magnitude2){
+	double weight = 1.0 - 2.0 * fabs(1.0 - sqrt(magnitude2) / GRAVITY);
+	return (weight > 0) ? weight : 0;
+}
+
+int main(int argc, char *argv[]){
+
+	const uint32_t band = (uint32_t)2 * GRAVITY * 2 * GRAVITY; //(2g)^2, exhaustive up to there
+	const uint32_t last = (uint32_t)3 * 32768 * 32768;
+	double maxError = 0;
+	uint32_t maxErrorAt = 0;
+	uint32_t failures = 0;
+
+	for(uint64_t magnitude2 = 0 ; magnitude2 <= last ; magnitude2 += (magnitude2 < band) ? 1 : 997){
+		uint16_t weight = Accel_weight_q15_of(magnitude2);
+		double error = fabs(weight / 32768.0 - exactWeight(magnitude2));
+
+		if(error > maxError){
+			maxError = error;
+			maxErrorAt = magnitude2;
+		}
+		if((error > WEIGHT_MAX_ERROR) || (weight > 32768)){
+			if(failures++ < 10){
+				printf("FAILED: weight %u at %.4fg (exact %.5f)\n", weight, sqrt(magnitude2) / GRAVITY, exactWeight(magnitude2));
+			}
+		}
+	}
+
+	//Band ends and top
+	if(Accel_weight_q15_of((uint32_t)GRAVITY * GRAVITY) != 32768){
+		printf("FAILED: weight %u at 1g\n", Accel_weight_q15_of((uint32_t)GRAVITY * GRAVITY));
+		failures++;
+	}
+	if((Accel_weight_q15_of((uint32_t)GRAVITY * GRAVITY / 4) != 0) || (Accel_weight_q15_of((uint32_t)9 * GRAVITY * GRAVITY / 4) != 0)){
+		printf("FAILED: weight not 0 at 0.5g or 1.5g\n");
+		failures++;
+	}
+
+	//Accel_weight_q15() from the accelerometer values: along Z, and on the 3 axes
+	for(int32_t value = -32768 ; value <= 32767 ; value++){
+		accel_x = 0;
+		accel_y = 0;
+		accel_z = value;
+		uint16_t alongZ = Accel_weight_q15();
+		accel_x = value;
+		accel_y = value;
+		uint16_t diagonal = Accel_weight_q15();
+		if((alongZ != Accel_weight_q15_of((uint32_t)(value * value))) || (diagonal != Accel_weight_q15_of((uint32_t)3 * (uint32_t)(value * value)))){
+			if(failures++ < 10){
+				printf("FAILED: Accel_weight_q15() at %d\n", value);
+			}
+		}
+	}
+
+	printf("Largest error %.5f of full weight (bound %.4f) at %.4fg\n", maxError, WEIGHT_MAX_ERROR, sqrt(maxErrorAt) / GRAVITY);
+	if(failures > 0){
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -9,29 +9,185 @@
 #define F_CPU 8000000UL
 
 
-#include <avr/io.h>
-#include <util/delay.h>
-#include <avr/interrupt.h>
-
+#include "monni_hal.h"
 #include "monni_i2c.h"
+#include "monni_clock.h"
+#include "monni_scheduler.h"
+
+//Tasks rates
+#define AHRS_HZ 50 //Gyro, accelerometer and DCM
+#define COMPASS_HZ 10 //Magnetometer (12.5Hz output data rate)
+#define SEQUENCE_HZ 10 //Motors start and stop sequence
+
+//PMW_SIMULTANEOUS=1 raises the 4 motor pins together and clears each one at the end of its pulse:
+//a frame lasts max(servo[]) instead of the sum of the 4 pulses, every motor has the same delay.
+//PMW_SIMULTANEOUS=0 pulses PD1 to PD4 one after the other.
+#define PMW_SIMULTANEOUS 1
+
+//Motor output protocols. servo[] is always given in standard PMW microseconds (700 to 2300).
+#define PMW_50HZ 0 //Standard PMW, 20ms period
+#define PMW_400HZ 1 //Fast PMW, 2.5ms period
+#define PMW_ONESHOT125 2 //servo[]/8 pulses (125 to 250us for 1000 to 2000), sent by pmwTrigger() after each control loop
+#ifndef PMW_PROTOCOL //Can be given to the compiler (host quad_sim_oneshot)
+#define PMW_PROTOCOL PMW_50HZ
+#endif
+
+#if (PMW_PROTOCOL != PMW_50HZ) && (PMW_SIMULTANEOUS == 0)
+#error "400Hz and OneShot125 need PMW_SIMULTANEOUS (4 sequential pulses do not fit in the period)"
+#endif
 
-//Timer related variables
-volatile uint32_t t0OvfCount = 0;
-uint8_t previousCount = 0;
-uint8_t pastCount = 0;
+#if PMW_PROTOCOL == PMW_ONESHOT125
+//Timer 1 without prescaler: 8 ticks per us, so a OneShot125 pulse of servo[]/8 us lasts servo[] ticks
+#define PMW_TICKS_SHIFT 3
+#define PMW_PRESCALER (1<<CS10)
+#else
+//Timer 1 prescaler of 8 because 8MHz clock source: 1 tick per us
+#define PMW_TICKS_SHIFT 0
+#define PMW_PRESCALER (1<<CS11)
+#endif
 
-//Donne le temps d'execution du programme en ms (compte au max environ 1.5 mois soit environ 49 jours)
-//MIS A JOUR SEULEMENT TOUTES LES 20MS VIA LA GENERATION PMW.
-volatile uint32_t timeFromStartMs = 0;
+#define PMW_TICKS_PER_US (1<<PMW_TICKS_SHIFT)
+
+#if PMW_PROTOCOL == PMW_ONESHOT125
+//Timer 1 turns (8.19ms each) without pmwTrigger() before the last servo[] are sent again, so the ESCs
+//never lose their signal. Longer than the control loop period: while the AHRS runs, every frame starts from an update.
+#define PMW_ONESHOT_KEEPALIVE 3
+#endif
+
+#if PMW_PROTOCOL == PMW_400HZ
+#define PMW_PERIOD 2500 //Ticks
+#else
+#define PMW_PERIOD 20000 //Ticks
+#endif
+
+//Two pulse ends closer than that (in ticks, 16us) are handled in the same interrupt
+#define PMW_MIN_GAP (16 * PMW_TICKS_PER_US)
+
+#define MOTORS_PINS (1<<PORTD1 | 1<<PORTD2 | 1<<PORTD3 | 1<<PORTD4)
 
 volatile uint16_t servo[4] = {2300, 2300, 2300, 2300}; //Initial speed in microseconds
+#if PMW_SIMULTANEOUS == 1
+volatile int8_t channel = -1; //Next pulse end to handle (0 to 3, shortest first), -1 waiting for the next period
+#else
 volatile int8_t channel = 1; //Controlled motor number : 1, 2, 3 or 4
+#endif
 volatile uint16_t startPmwTcnt1 = 0; //TCNT1 value when the PMW cycle starts
 
+//Pulse ends of the current period sorted from the shortest, and the matching motor pins
+uint16_t pulseEnd[4];
+uint8_t pulsePin[4];
+
+#if PMW_PROTOCOL == PMW_ONESHOT125
+volatile uint8_t pmwIdleTurns = 0; //Timer 1 turns since the end of the last frame
+volatile uint8_t pmwPending = 0; //pmwTrigger() called during a frame: the next one starts at its end
+#endif
+
 //Signed boolean to know where we are in the initialisation process.
 //A value of -1 means initialisation completed.
 volatile int8_t initStep = 0;
 
+//AHRS uses the variables above (servo[])
+#include "monni_ahrs.h"
+
+//1 while the AHRS drives the motors, set by sequenceTask()
+uint8_t ahrsRunning = 0;
+
+void ahrsTask();
+void compassTask();
+void sequenceTask();
+
+//Fastest first. Phases (in us) keep the tasks from being released together.
+SchedulerTask tasks[] = {
+	{ahrsTask, SCHEDULER_HZ(AHRS_HZ), 0},
+	{compassTask, SCHEDULER_HZ(COMPASS_HZ), 500},
+	{sequenceTask, SCHEDULER_HZ(SEQUENCE_HZ), 1250}
+};
+
+#if PMW_SIMULTANEOUS == 1
+
+//Every motor pin goes high, the falling edges are scheduled from the shortest pulse.
+//Interrupts must be disabled.
+void pmwStartPeriod(uint16_t timerValue){
+	PORTD |= MOTORS_PINS;
+	startPmwTcnt1 = timerValue;
+	
+	//Sort the pulses (insertion sort, 4 values)
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		uint16_t value = servo[i];
+		int8_t j = i - 1;
+		while((j >= 0) && (pulseEnd[j] > value)){
+			pulseEnd[j + 1] = pulseEnd[j];
+			pulsePin[j + 1] = pulsePin[j];
+			j--;
+		}
+		pulseEnd[j + 1] = value;
+		pulsePin[j + 1] = 1<<(i + 1);
+	}
+	
+	channel = 0;
+	OCR1A = startPmwTcnt1 + pulseEnd[0];
+}
+
+#if PMW_PROTOCOL == PMW_ONESHOT125
+//Send the OneShot125 pulses now with the last servo[] values. Call it right after each control loop.
+//During a frame, they are sent as soon as it ends (250us at most).
+void pmwTrigger(){
+	cli();
+	if(channel < 0){
+		pmwStartPeriod(TCNT1);
+	}
+	else{
+		pmwPending = 1;
+	}
+	sei();
+}
+#endif
+
+//PMW Building ISR
+ISR(TIMER1_COMPA_vect)
+{
+	if(channel < 0){ //Start of a period
+#if PMW_PROTOCOL == PMW_ONESHOT125
+		if(++pmwIdleTurns >= PMW_ONESHOT_KEEPALIVE){ //No pmwTrigger() for a while
+			pmwStartPeriod(TCNT1);
+		}
+#else
+		pmwStartPeriod(TCNT1);
+#endif
+	}
+	else{
+		//Clear every pin whose pulse ends now or within PMW_MIN_GAP ticks
+		while((channel < 4) && ((uint16_t)(TCNT1 - startPmwTcnt1) + PMW_MIN_GAP >= pulseEnd[channel])){
+			while((uint16_t)(TCNT1 - startPmwTcnt1) < pulseEnd[channel]); //Wait for the exact end
+			PORTD &= ~pulsePin[channel];
+			channel++;
+		}
+		
+		if(channel < 4){
+			OCR1A = startPmwTcnt1 + pulseEnd[channel];
+		}
+		else{
+#if PMW_PROTOCOL == PMW_ONESHOT125
+			//Next pulses sent by pmwTrigger(), or by this ISR once TCNT1 came back
+			//to the frame start PMW_ONESHOT_KEEPALIVE times
+			OCR1A = startPmwTcnt1;
+			pmwIdleTurns = 0;
+			channel = -1; //Wait for the next period
+			if(pmwPending){ //Updated during this frame: next frame after a PMW_MIN_GAP low time
+				pmwPending = 0;
+				pmwIdleTurns = PMW_ONESHOT_KEEPALIVE - 1;
+				OCR1A = TCNT1 + PMW_MIN_GAP;
+			}
+#else
+			OCR1A = startPmwTcnt1 + PMW_PERIOD;
+			channel = -1; //Wait for the next period
+#endif
+		}
+	}
+}
+
+#else
+
 //PMW Building ISR
 ISR(TIMER1_COMPA_vect)
 {
@@ -43,7 +199,6 @@ ISR(TIMER1_COMPA_vect)
 		PORTD |= 1<<channel;
 		startPmwTcnt1 = timerValue;
 		OCR1A = timerValue + servo[0];
-		timeFromStartMs += 20;
 	}
 	else{
 		if(channel < 4){ //Last servo pin just goes high
@@ -54,12 +209,14 @@ ISR(TIMER1_COMPA_vect)
 		}
 		else{
 			PORTD &= ~(1<<channel); //Clear the last motor pin
-			OCR1A = startPmwTcnt1 + 20000;
+			OCR1A = startPmwTcnt1 + PMW_PERIOD;
 			channel = -1; //Wait for the next period
 		}
 	}
 }
 
+#endif
+
 
 //**********************************//
 //Main
@@ -68,12 +225,16 @@ ISR(TIMER1_COMPA_vect)
 int main(void){
 
 	//PMW
-	TCCR1B |= 1<<CS11; //Prescaler of 8 because 8MHz clock source
+	TCCR1B |= PMW_PRESCALER;
 	TIMSK1 |= (1<<OCIE1A); //Interrupt on OCR1A
-	OCR1A = servo[0]; //Set the first interrupt to occur when the first pulse was ended
-	
+	clockInit(PMW_TICKS_SHIFT); //Program time from Timer 1 overflows
 	DDRD |= 1<<DDD0 | 1<<DDD1 | 1<<DDD2 | 1<<DDD3 | 1<<DDD4; //LED and motors as output
+#if PMW_SIMULTANEOUS == 1
+	OCR1A = TCNT1 + 100 * PMW_TICKS_PER_US; //First period starts in 100us
+#else
+	OCR1A = servo[0]; //Set the first interrupt to occur when the first pulse was ended
 	PORTD = 1<<channel; //Set first servo pin high
+#endif
 	
 	sei(); //Enable global interrupts
 	
@@ -91,9 +252,11 @@ int main(void){
 	
 	//Configure sensors
 	//Calculate sensors' offsets
-	//Initialise Timer 0 for loop timing
 	AhrsInit();
 	
+	//Tasks releases from now
+	schedulerInit(tasks, sizeof(tasks) / sizeof(tasks[0]));
+	
 	sei(); //Enable global interrupts
 	
 	//*******************************
@@ -102,24 +265,59 @@ int main(void){
 	
 	while(1){
 	
-		if((timeFromStartMs > 2300) && (timeFromStartMs < 7000)){
-			servo[0] = 700;
-			servo[1] = 700;
-			servo[2] = 700;
-			servo[3] = 700;
+		schedulerRun();
+		
+#if (AHRS_TWI_ASYNC == 1) || (AHRS_DATA_READY == 1)
+		if(ahrsRunning){
+			AhrsPoll(); //DCM as soon as the sensors are read
 		}
+#endif
+
+#if PMW_PROTOCOL == PMW_ONESHOT125
+		if(ahrsUpdated){
+			ahrsUpdated = 0;
+			pmwTrigger(); //New motor commands out right away
+		}
+#endif
 		
-		if(timeFromStartMs > 15000){
+		halIdle();
+	}
+}
+
+//**********************************//
+//Tasks
+//**********************************//
+
+void ahrsTask(){
+#if AHRS_DATA_READY == 0 //Else the AHRS follows the sensors data ready lines
+	if(ahrsRunning){
+		AhrsCompute();
+	}
+#endif
+}
+
+void compassTask(){
+	if(ahrsRunning){
+		AhrsCompass();
+	}
+}
+
+//Motors start and stop sequence, from the program time
+void sequenceTask(){
+
+	uint32_t now = clockMillis();
+	
+	if((now > 7000) && (now < 15000)){
+		ahrsRunning = 1;
+	}
+	else{
+		ahrsRunning = 0;
+		
+		if(now > 2300){
 			servo[0] = 700;
 			servo[1] = 700;
 			servo[2] = 700;
 			servo[3] = 700;
 		}
-		
-		if((timeFromStartMs > 7000) && (timeFromStartMs < 15000)){
-			AhrsCompute();
-		}
-		
-		
 	}
-}
\ No newline at end of file
+}
@@ -9,6 +9,10 @@
 #include <stdlib.h>
 #include <math.h>
 
+#include "monni_hal.h"
+#include "monni_clock.h"
+#include "monni_scheduler.h"
+
 // LSM303 magnetometer calibration constants; use the Calibrate example from
 // the Pololu LSM303 library to find the right values for your board
 /*#define M_X_MIN -2566
@@ -33,9 +37,9 @@
 #define Gyro_Gain_X 0.07 //X axis Gyro gain
 #define Gyro_Gain_Y 0.07 //Y axis Gyro gain
 #define Gyro_Gain_Z 0.07 //Z axis Gyro gain
-#define Gyro_Scaled_X(x) ((x)*ToRad(Gyro_Gain_X)) //Return the scaled ADC raw data of the gyro in radians for second
-#define Gyro_Scaled_Y(x) ((x)*ToRad(Gyro_Gain_Y)) //Return the scaled ADC raw data of the gyro in radians for second
-#define Gyro_Scaled_Z(x) ((x)*ToRad(Gyro_Gain_Z)) //Return the scaled ADC raw data of the gyro in radians for second
+#define Gyro_Scaled_X(x) ((x)*(float)ToRad(Gyro_Gain_X)) //Return the scaled ADC raw data of the gyro in radians for second
+#define Gyro_Scaled_Y(x) ((x)*(float)ToRad(Gyro_Gain_Y)) //Return the scaled ADC raw data of the gyro in radians for second
+#define Gyro_Scaled_Z(x) ((x)*(float)ToRad(Gyro_Gain_Z)) //Return the scaled ADC raw data of the gyro in radians for second
 
 #define Kp_ROLLPITCH 0.02
 #define Ki_ROLLPITCH 0.00002
@@ -47,21 +51,126 @@
 //OUTPUTMODE=0 will print uncorrected data of the gyros (with drift)
 #define OUTPUTMODE 1
 
+//AHRS_FIXED_POINT=1 will run the DCM in Q16.16 fixed point (see monni_ahrs_fixed.h),
+//AHRS_FIXED_POINT=0 will run the DCM in float (soft-float on the ATmega328p)
+#ifndef AHRS_FIXED_POINT //Can be given to the compiler ("make bench-fixed")
+#define AHRS_FIXED_POINT 0
+#endif
+
+//AHRS_QUATERNION=1 integrates the attitude on a quaternion (see monni_ahrs_quaternion.h), float only:
+//fewer operations per gyro sample, same drift correction and outputs.
+//AHRS_QUATERNION=0 integrates the 3x3 DCM.
+#define AHRS_QUATERNION 0
+
+#if (AHRS_QUATERNION == 1) && (AHRS_FIXED_POINT == 1)
+#error "AHRS_QUATERNION has no fixed point version"
+#endif
+
+//AHRS_TWI_ASYNC=1 reads the sensors with the interrupt driven TWI queue (monni_i2c.c): AhrsCompute()
+//queues the reads and returns, the DCM runs on a later call once every byte is received.
+//AHRS_TWI_ASYNC=0 reads the sensors with the blocking TWI functions.
+#define AHRS_TWI_ASYNC 1
+
+//AHRS_DATA_READY=1 reads each gyro and accelerometer sample once, as soon as the sensor says it is ready,
+//and timestamps it. L3G4200D DRDY/INT2 on PB0 and LSM303D INT1 on PB1 (pin change interrupts: INT0 and
+//INT1 pins are motor outputs). The DCM runs on every gyro sample, G_Dt is the time between two samples.
+//With AHRS_GYRO_FIFO=1 the gyro line is the FIFO watermark instead.
+//AHRS_DATA_READY=0 reads the sensors at the ahrsTask rate, whatever their state.
+#ifndef AHRS_DATA_READY //Can be given to the compiler ("make bench-dataready")
+#define AHRS_DATA_READY 0
+#endif
+
+//Normalize() checks the orthonormality error of the DCM (|line 0 . line 1| + |1 - line 2 . line 2|)
+//and runs the full renormalization (eq.19 to 21) only when it reaches NORMALIZE_THRESHOLD, or
+//after NORMALIZE_EVERY iterations without one. NORMALIZE_EVERY=1 renormalizes at every iteration.
+#define NORMALIZE_THRESHOLD 0.0005
+#define NORMALIZE_EVERY 16
+
+//AHRS_GYRO_FIFO=1 runs the gyro at 200Hz in FIFO stream mode. Each read takes every stored sample in
+//one burst (FIFO_SRC, then the output registers: they roll back from 0x2D to 0x28 in FIFO mode) and
+//Matrix_update() integrates them one by one, G_Dt being the sample period.
+//AHRS_GYRO_FIFO=0 reads the last gyro sample only (100Hz output data rate).
+#define AHRS_GYRO_FIFO 1
+
+#if AHRS_GYRO_FIFO == 1
+#define GYRO_CTRL1 0b01101111 //200Hz, 50Hz cut-off, normal power mode, all axis enabled
+#define GYRO_SAMPLE_US 5000
+#define GYRO_FIFO_SIZE 8 //Samples read at most at once (the FIFO holds 32)
+#define GYRO_FIFO_WATERMARK 4 //Watermark interrupt level for AHRS_DATA_READY (20ms at 200Hz)
+#else
+#define GYRO_CTRL1 0x0F //100Hz, 12.5Hz cut-off, normal power mode, all axis enabled
+#define GYRO_FIFO_SIZE 1
+#endif
+
+//AHRS_ACCEL_FIFO=1 runs the accelerometer at 200Hz (50Hz anti-alias filter) in FIFO stream mode. Each read
+//takes every stored sample in one burst and Accel_decode() averages them (boxcar) before Drift_correction().
+//With AHRS_DATA_READY the accelerometer is read with the gyro (its FIFO threshold is on INT2 only).
+//AHRS_ACCEL_FIFO=0 reads the last accelerometer sample only (50Hz output data rate).
+#define AHRS_ACCEL_FIFO 1
+
+#if AHRS_ACCEL_FIFO == 1
+#define ACCEL_CTRL1 0b01110111 //200Hz + 3 axis enable
+#define ACCEL_CTRL2 0b11011000 //50Hz anti-alias filter, full scale +/-8g
+#define ACCEL_FIFO_SIZE 8 //Samples read at most at once (the FIFO holds 32)
+#else
+#define ACCEL_CTRL1 0b01010111 //50Hz + 3 axis enable
+#define ACCEL_CTRL2 0x18 //773Hz anti-alias filter, full scale +/-8g
+#define ACCEL_FIFO_SIZE 1
+#endif
+
+#define GYRO_DRDY_PIN PINB0
+#define ACCEL_DRDY_PIN PINB1
+
 
 //7 bits accelerometer's address 
 const uint8_t accelAdd = 0b0011101;
 //7 bits gyro's address 
 const uint8_t gyroAdd = 0b1101011;
 
+//Tries of a blocking read or write before giving up (each one lasts TWI_TIMEOUT_LOOPS per bus event at most)
+#define AHRS_TWI_RETRIES 3
+
+//Failed TWI transactions, per device
+uint16_t gyroErrors = 0; //L3G4200D
+uint16_t accelErrors = 0; //LSM303D, accelerometer and magnetometer
+
 //Raw value of gravity. 8g max on 16 signed bits => 1g = 4096.
 const int16_t GRAVITY = 4096;
 
-//Integration time (DCM algorithm)  We will run the integration loop at 50Hz if possible
-float G_Dt=0.02;
+//Raw bytes of a sensors sweep, one buffer for every sensor, in the registers order
+typedef struct {
+	uint8_t gyro[6*GYRO_FIFO_SIZE];
+	uint8_t accel[6*ACCEL_FIFO_SIZE];
+	uint8_t compass[6];
+} AhrsSample;
+
+AhrsSample ahrsSample;
+uint8_t gyroSamples = 0; //Number of samples in ahrsSample.gyro, integrated by the next Ahrs_calculations()
+uint8_t accelSamples = 0; //Number of samples in ahrsSample.accel, averaged by the next Accel_decode()
+
+#if AHRS_TWI_ASYNC == 1
+TwiTransaction gyroRead;
+TwiTransaction accelRead;
+TwiTransaction compassRead;
+#if AHRS_GYRO_FIFO == 1
+TwiTransaction gyroFifoRead; //FIFO_SRC, its callback queues gyroRead for the stored samples
+uint8_t gyroFifoSrc;
+#endif
+#if AHRS_ACCEL_FIFO == 1
+TwiTransaction accelFifoRead; //FIFO_SRC, its callback queues accelRead for the stored samples
+uint8_t accelFifoSrc;
+#endif
 
-//Temp values use to read gyro and accelerometer values.
-uint8_t gyroSplitedValues[6];
-uint8_t accelSplitedValues[6];
+uint8_t ahrsReading = 0; //1 while the reads queued by AhrsCompute() are not all received
+
+//Sensors sweep: the reads of AhrsCompute() (and the magnetometer when due) chained with REPEATED STARTs
+uint8_t compassDue = 0; //Set by AhrsCompass(), the magnetometer is read by the next sweep
+uint8_t sweepCompass = 0; //The running sweep reads the magnetometer
+uint32_t sweepStartUs = 0;
+volatile uint32_t sweepEndUs = 0; //End of the last read, set from TWI_vect
+uint16_t ahrsSweepUs = 0; //Bus time of the last sweep, from queued (data ready edge with AHRS_DATA_READY) to last byte received
+uint16_t ahrsSweepMaxUs = 0;
+#endif
 
 //Computed values
 int16_t gyro_x;
@@ -76,78 +185,153 @@ int16_t magnetom_z;
 float c_magnetom_x;
 float c_magnetom_y;
 float c_magnetom_z;
-float MAG_Heading;
 
-// Euler angles
+// Euler angles, computed on demand by AhrsEuler()
 float roll;
 float pitch;
 float yaw;
 
-float Accel_Vector[3]= {0,0,0}; //Store the acceleration in a vector
-float Gyro_Vector[3]= {0,0,0};//Store the gyros turn rate in a vector
-float Omega_Vector[3]= {0,0,0}; //Corrected Gyro_Vector data
-float Omega_P[3]= {0,0,0};//Omega Proportional correction
-float Omega_I[3]= {0,0,0};//Omega Integrator
-float Omega[3]= {0,0,0};
-
-float errorRollPitch[3]= {0,0,0}; 
-float errorYaw[3]= {0,0,0};
+//DCM iterations done, and the one roll, pitch and yaw were computed for
+uint32_t ahrsIteration = 0;
+uint32_t eulerIteration = 0;
 
-float DCM_Matrix[3][3]= {
-  {
-    1,0,0  }
-  ,{
-    0,1,0  }
-  ,{
-    0,0,1  }
-}; 
-float Update_Matrix[3][3]={{0,1,2},{3,4,5},{6,7,8}}; //Gyros here
+//Full renormalizations done by Normalize()
+uint32_t ahrsRenormalizations = 0;
+uint8_t normalizeSkipped = 0; //Iterations since the last one
 
+//servo[0] follows the pitch (debug): 10us per degree around level, from sin(pitch)
+#define PITCH_SERVO_GAIN 573.0
 
-float Temporary_Matrix[3][3]={
-  {
-    0,0,0  }
-  ,{
-    0,0,0  }
-  ,{
-    0,0,0  }
-};
-
-// Uncomment the below line to use this axis definition: 
+//Axes definition, folded into the decode functions at compile time (no sign table at run time).
+//AHRS_AXES_Z_DOWN=1:
    // X axis pointing forward
    // Y axis pointing to the right 
    // and Z axis pointing down.
 // Positive pitch : nose up
 // Positive roll : right wing down
 // Positive yaw : clockwise
-int8_t SENSOR_SIGN[9] = {1,1,1,-1,-1,-1,1,1,1}; //Correct directions x,y,z - gyro, accelerometer, magnetometer
-// Uncomment the below line to use this axis definition: 
+//AHRS_AXES_Z_DOWN=0:
    // X axis pointing forward
    // Y axis pointing to the left 
    // and Z axis pointing up.
 // Positive pitch : nose down
 // Positive roll : right wing down
 // Positive yaw : counterclockwise
-//int8_t SENSOR_SIGN[9] = {1,-1,-1,-1,1,1,1,-1,-1}; //Correct directions x,y,z - gyro, accelerometer, magnetometer
+#define AHRS_AXES_Z_DOWN 1
+
+//Correct directions x,y,z - gyro, accelerometer, magnetometer
+#if AHRS_AXES_Z_DOWN == 1
+#define GYRO_SIGN_X 1
+#define GYRO_SIGN_Y 1
+#define GYRO_SIGN_Z 1
+#define ACCEL_SIGN_X -1
+#define ACCEL_SIGN_Y -1
+#define ACCEL_SIGN_Z -1
+#define MAG_SIGN_X 1
+#define MAG_SIGN_Y 1
+#define MAG_SIGN_Z 1
+#else
+#define GYRO_SIGN_X 1
+#define GYRO_SIGN_Y -1
+#define GYRO_SIGN_Z -1
+#define ACCEL_SIGN_X -1
+#define ACCEL_SIGN_Y 1
+#define ACCEL_SIGN_Z 1
+#define MAG_SIGN_X 1
+#define MAG_SIGN_Y -1
+#define MAG_SIGN_Z -1
+#endif
+
+//Magnetometer calibration of Compass_Heading(): center (sign corrected) and scale to the +/-0.5 range
+#define M_X_CENTER ((M_X_MIN + M_X_MAX) * 0.5 * MAG_SIGN_X)
+#define M_Y_CENTER ((M_Y_MIN + M_Y_MAX) * 0.5 * MAG_SIGN_Y)
+#define M_Z_CENTER ((M_Z_MIN + M_Z_MAX) * 0.5 * MAG_SIGN_Z)
+#define M_X_SCALE (1.0 / (M_X_MAX - M_X_MIN))
+#define M_Y_SCALE (1.0 / (M_Y_MAX - M_Y_MIN))
+#define M_Z_SCALE (1.0 / (M_Z_MAX - M_Z_MIN))
 
 int16_t MAN[3];
 int16_t AN[6]; //array that stores the gyro and accelerometer data
-int32_t AN_OFFSET[6]={0,0,0,0,0,0}; //Array that stores the Offset of the sensors gXYZ - aXYZ
+int16_t AN_OFFSET[6]={0,0,0,0,0,0}; //Array that stores the Offset of the sensors gXYZ - aXYZ
 
-int8_t compassCounter = 0;
+//Set to 1 by each DCM iteration (new servo[] values), cleared by the user
+uint8_t ahrsUpdated = 0;
 
-float constrain(float x, float a, float b){
-	if(x < a){
-		return a;
-	}
-	else if(x > b){
-		return b;
+#if AHRS_DATA_READY == 1
+volatile uint8_t drdyHistory = 0; //PINB at the last pin change
+volatile uint32_t gyroSampleUs = 0; //Time of the last gyro DRDY rising edge
+volatile uint32_t accelSampleUs = 0; //Time of the last accelerometer DRDY rising edge
+uint32_t lastGyroSampleUs = 0; //Time of the gyro sample used by the last DCM iteration
+#if AHRS_TWI_ASYNC == 0
+volatile uint8_t gyroReady = 0;
+volatile uint8_t accelReady = 0;
+#endif
+#endif
+
+//Accelerometer weight of Drift_correction() (reliability filter) in Q15: 1 - 2*|1 - |a|/g|, so 1 at 1g,
+//0 below 0.5g and above 1.5g. Taken on the integer squared magnitude, without sqrt nor division:
+//ACCEL_WEIGHT holds the curve every 0.125g^2 from (0.5g)^2 to (1.5g)^2, linear in between
+//(0.6% of full weight at most from the exact curve).
+#define ACCEL_WEIGHT_LOW ((uint32_t)4096*4096/4) //(0.5g)^2 with GRAVITY = 4096
+#define ACCEL_WEIGHT_SHIFT 21 //0.125g^2 = 4096^2/8 = 2^21
+const uint16_t ACCEL_WEIGHT[17] = {0, 7364, 13573, 19043, 23988, 28535, 32768, 28793, 25033, 21456, 18039, 14762, 11608, 8565, 5622, 2770, 0};
+
+//Weight of a squared magnitude (raw units)
+uint16_t Accel_weight_q15_of(uint32_t magnitude2){
+	if(magnitude2 <= ACCEL_WEIGHT_LOW){
+		return 0;
 	}
-	else{
-		return x;
+	magnitude2 -= ACCEL_WEIGHT_LOW;
+	
+	uint32_t index = magnitude2 >> ACCEL_WEIGHT_SHIFT;
+	if(index >= 16){
+		return 0;
 	}
+	int32_t fraction = (magnitude2 >> (ACCEL_WEIGHT_SHIFT - 16)) & 0xFFFF; //Q16 between two points
+	int32_t slope = (int32_t)ACCEL_WEIGHT[index + 1] - ACCEL_WEIGHT[index];
+	return ACCEL_WEIGHT[index] + ((slope * fraction) >> 16);
 }
 
+//Weight of the last accelerometer values
+uint16_t Accel_weight_q15(){
+	return Accel_weight_q15_of((uint32_t)((int32_t)accel_x*accel_x) + (uint32_t)((int32_t)accel_y*accel_y) + (uint32_t)((int32_t)accel_z*accel_z));
+}
+
+#if AHRS_FIXED_POINT == 1
+
+#include "monni_ahrs_fixed.h"
+
+#else
+
+//Integration time (DCM algorithm)  We will run the integration loop at 50Hz if possible
+float G_Dt=0.02;
+
+float Accel_Vector[3]= {0,0,0}; //Store the acceleration in a vector
+float Gyro_Vector[3]= {0,0,0};//Store the gyros turn rate in a vector
+float Omega_Vector[3]= {0,0,0}; //Corrected Gyro_Vector data
+float Omega_P[3]= {0,0,0};//Omega Proportional correction
+float Omega_I[3]= {0,0,0};//Omega Integrator
+float Omega[3]= {0,0,0};
+
+float errorRollPitch[3]= {0,0,0}; 
+float errorYaw[3]= {0,0,0};
+
+//Magnetic heading as a unit vector (cos, sin), updated by Compass_Heading() only
+float mag_heading_x = 1;
+float mag_heading_y = 0;
+
+//DCM element as a float (Compass_Heading())
+#define DcmToFloat(x) (x)
+
+float DCM_Matrix[3][3]= {
+  {
+    1,0,0  }
+  ,{
+    0,1,0  }
+  ,{
+    0,0,1  }
+}; 
+
 //**********************************//
 //MATRIX Calculations
 //**********************************//
@@ -190,25 +374,11 @@ void Vector_Add(float vectorOut[3],float vectorIn1[3], float vectorIn2[3])
   }
 }
 
-//Multiply two 3x3 matrixs. This function developed by Jordi can be easily adapted to multiple n*n matrix's. (Pero me da flojera!). 
-void Matrix_Multiply(float a[3][3], float b[3][3],float mat[3][3])
-{
-	float op[3]; 
-	for(int x=0; x<3; x++)
-	{
-		for(int y=0; y<3; y++)
-		{
-			for(int w=0; w<3; w++)
-			{
-			op[w]=a[x][w]*b[w][y];
-			} 
-			mat[x][y]=0;
-			mat[x][y]=op[0]+op[1]+op[2];
-  
-			//float test=mat[x][y];
-		}
-	}
-}
+#if AHRS_QUATERNION == 1
+
+#include "monni_ahrs_quaternion.h"
+
+#else
 
 void Normalize(void)
 {
@@ -217,6 +387,15 @@ void Normalize(void)
   float renorm=0;
   
   error= -Vector_Dot_Product(&DCM_Matrix[0][0],&DCM_Matrix[1][0])*.5; //eq.19
+  
+  //Orthonormal enough: skip the renormalization (see NORMALIZE_THRESHOLD)
+  if((2*fabs(error) + fabs(1 - Vector_Dot_Product(&DCM_Matrix[2][0],&DCM_Matrix[2][0])) < NORMALIZE_THRESHOLD)
+    && (++normalizeSkipped < NORMALIZE_EVERY))
+  {
+    return;
+  }
+  normalizeSkipped=0;
+  ahrsRenormalizations++;
 
   Vector_Scale(&temporary[0][0], &DCM_Matrix[1][0], error); //eq.19
   Vector_Scale(&temporary[1][0], &DCM_Matrix[0][0], error); //eq.19
@@ -237,27 +416,23 @@ void Normalize(void)
   
 }
 
+#endif
+
 /**************************************************/
 void Drift_correction(void)
 {
-  float mag_heading_x;
-  float mag_heading_y;
   float errorCourse;
   //Compensation the Roll, Pitch and Yaw drift. 
   static float Scaled_Omega_P[3];
   static float Scaled_Omega_I[3];
-  float Accel_magnitude;
   float Accel_weight;
   
   
   //*****Roll and Pitch***************
 
-  // Calculate the magnitude of the accelerometer vector
-  Accel_magnitude = sqrt(Accel_Vector[0]*Accel_Vector[0] + Accel_Vector[1]*Accel_Vector[1] + Accel_Vector[2]*Accel_Vector[2]);
-  Accel_magnitude = Accel_magnitude / GRAVITY; // Scale to gravity.
   // Dynamic weighting of accelerometer info (reliability filter)
   // Weight for accelerometer info (<0.5G = 0.0, 1G = 1.0 , >1.5G = 0.0)
-  Accel_weight = constrain(1 - 2*abs(1 - Accel_magnitude),0,1);  //  
+  Accel_weight = Accel_weight_q15() * (1.0/32768);
 
   Vector_Cross_Product(&errorRollPitch[0],&Accel_Vector[0],&DCM_Matrix[2][0]); //adjust the ground of reference
   Vector_Scale(&Omega_P[0],&errorRollPitch[0],Kp_ROLLPITCH*Accel_weight);
@@ -268,8 +443,6 @@ void Drift_correction(void)
   //*****YAW***************
   // We make the gyro YAW drift correction based on compass magnetic heading
  
-  mag_heading_x = cos(MAG_Heading);
-  mag_heading_y = sin(MAG_Heading);
   errorCourse=(DCM_Matrix[0][0]*mag_heading_y) - (DCM_Matrix[1][0]*mag_heading_x);  //Calculating YAW error
   Vector_Scale(errorYaw,&DCM_Matrix[2][0],errorCourse); //Applys the yaw correction to the XYZ rotation of the aircraft, depeding the position.
   
@@ -289,6 +462,8 @@ void Accel_adjust(void)
 */
 /**************************************************/
 
+#if AHRS_QUATERNION == 0
+
 void Matrix_update(void)
 {
   Gyro_Vector[0]=Gyro_Scaled_X(gyro_x); //gyro x roll
@@ -302,43 +477,32 @@ void Matrix_update(void)
   Vector_Add(&Omega[0], &Gyro_Vector[0], &Omega_I[0]);  //adding proportional term
   Vector_Add(&Omega_Vector[0], &Omega[0], &Omega_P[0]); //adding Integrator term
 
+  float theta[3]; //Rotation of this sample (rad)
+
   //Accel_adjust();    //Remove centrifugal acceleration.   We are not using this function in this version - we have no speed measurement
   
  #if OUTPUTMODE==1         
-  Update_Matrix[0][0]=0;
-  Update_Matrix[0][1]=-G_Dt*Omega_Vector[2];//-z
-  Update_Matrix[0][2]=G_Dt*Omega_Vector[1];//y
-  Update_Matrix[1][0]=G_Dt*Omega_Vector[2];//z
-  Update_Matrix[1][1]=0;
-  Update_Matrix[1][2]=-G_Dt*Omega_Vector[0];//-x
-  Update_Matrix[2][0]=-G_Dt*Omega_Vector[1];//-y
-  Update_Matrix[2][1]=G_Dt*Omega_Vector[0];//x
-  Update_Matrix[2][2]=0;
-
+  Vector_Scale(theta, Omega_Vector, G_Dt);
  #else                    // Uncorrected data (no drift correction)
-  Update_Matrix[0][0]=0;
-  Update_Matrix[0][1]=-G_Dt*Gyro_Vector[2];//-z
-  Update_Matrix[0][2]=G_Dt*Gyro_Vector[1];//y
-  Update_Matrix[1][0]=G_Dt*Gyro_Vector[2];//z
-  Update_Matrix[1][1]=0;
-  Update_Matrix[1][2]=-G_Dt*Gyro_Vector[0];
-  Update_Matrix[2][0]=-G_Dt*Gyro_Vector[1];
-  Update_Matrix[2][1]=G_Dt*Gyro_Vector[0];
-  Update_Matrix[2][2]=0;
+  Vector_Scale(theta, Gyro_Vector, G_Dt);
  #endif
 
-  Matrix_Multiply(DCM_Matrix,Update_Matrix,Temporary_Matrix); //a*b=c
-
-  for(int x=0; x<3; x++) //Matrix Addition (update)
+  //DCM = DCM + DCM*[theta x] : the update matrix is skew-symmetric with a zero diagonal,
+  //so each line gets its own cross product with theta (18 multiplies instead of 27 + 9 additions)
+  for(int x=0; x<3; x++)
   {
-    for(int y=0; y<3; y++)
-    {
-      DCM_Matrix[x][y]+=Temporary_Matrix[x][y];
-    } 
+    float a=DCM_Matrix[x][0];
+    float b=DCM_Matrix[x][1];
+    float c=DCM_Matrix[x][2];
+    DCM_Matrix[x][0]+=b*theta[2]-c*theta[1];
+    DCM_Matrix[x][1]+=c*theta[0]-a*theta[2];
+    DCM_Matrix[x][2]+=a*theta[1]-b*theta[0];
   }
 	
 }
 
+#endif
+
 void Euler_angles(void)
 {
   pitch = -asin(DCM_Matrix[2][0]);
@@ -347,192 +511,771 @@ void Euler_angles(void)
 }
 
 
+#endif
+
 //**********************************//
 //Compute magnetometer's values to calculate the Heading
 //**********************************//
+//The tilt terms are in the third DCM line (-sin(pitch), sin(roll)cos(pitch), cos(roll)cos(pitch)):
+//the field is brought to the horizontal plane with multiply-adds only, both components
+//scaled by cos(pitch), which does not change the heading.
 void Compass_Heading(){
 
 	float MAG_X;
 	float MAG_Y;
-	float cos_roll;
-	float sin_roll;
-	float cos_pitch;
-	float sin_pitch;
-
-	cos_roll = cos(roll);
-	sin_roll = sin(roll);
-	cos_pitch = cos(pitch);
-	sin_pitch = sin(pitch);
+	float dcm20 = DcmToFloat(DCM_Matrix[2][0]);
+	float dcm21 = DcmToFloat(DCM_Matrix[2][1]);
+	float dcm22 = DcmToFloat(DCM_Matrix[2][2]);
+	float norm;
+	float invNorm;
 
 	// adjust for LSM303 compass axis offsets/sensitivity differences by scaling to +/-0.5 range
-	c_magnetom_x = (float)(magnetom_x - SENSOR_SIGN[6]*M_X_MIN) / (M_X_MAX - M_X_MIN) - SENSOR_SIGN[6]*0.5;
-	c_magnetom_y = (float)(magnetom_y - SENSOR_SIGN[7]*M_Y_MIN) / (M_Y_MAX - M_Y_MIN) - SENSOR_SIGN[7]*0.5;
-	c_magnetom_z = (float)(magnetom_z - SENSOR_SIGN[8]*M_Z_MIN) / (M_Z_MAX - M_Z_MIN) - SENSOR_SIGN[8]*0.5;
+	c_magnetom_x = (magnetom_x - (float)M_X_CENTER) * (float)M_X_SCALE;
+	c_magnetom_y = (magnetom_y - (float)M_Y_CENTER) * (float)M_Y_SCALE;
+	c_magnetom_z = (magnetom_z - (float)M_Z_CENTER) * (float)M_Z_SCALE;
+
+	// Tilt compensated Magnetic filed X (times cos(pitch)):
+	MAG_X = c_magnetom_x*(dcm21*dcm21+dcm22*dcm22)-(c_magnetom_y*dcm21+c_magnetom_z*dcm22)*dcm20;
+	// Tilt compensated Magnetic filed Y (times cos(pitch)):
+	MAG_Y = c_magnetom_y*dcm22-c_magnetom_z*dcm21;
+
+	norm = sqrt(MAG_X*MAG_X+MAG_Y*MAG_Y);
+	if(norm == 0){
+		return; //Vertical field or no reading, keep the last heading
+	}
+	invNorm = 1.0f/norm; //One division for both components
+
+	//Heading unit vector used by Drift_correction() until the next compass reading
+#if AHRS_FIXED_POINT == 1
+	mag_heading_x = floatToQ15(MAG_X*invNorm);
+	mag_heading_y = floatToQ15(-MAG_Y*invNorm);
+#else
+	mag_heading_x = MAG_X*invNorm;
+	mag_heading_y = -MAG_Y*invNorm;
+#endif
 
-	// Tilt compensated Magnetic filed X:
-	MAG_X = c_magnetom_x*cos_pitch+c_magnetom_y*sin_roll*sin_pitch+c_magnetom_z*cos_roll*sin_pitch;
-	// Tilt compensated Magnetic filed Y:
-	MAG_Y = c_magnetom_y*cos_roll-c_magnetom_z*sin_roll;
-	// Magnetic Heading
-	MAG_Heading = atan2(-MAG_Y,MAG_X);
+}
+
+//Magnetic heading in radians (0 north, positive clockwise), from the last Compass_Heading()
+float Compass_Heading_angle(){
+	return atan2(mag_heading_y, mag_heading_x);
+}
 
+//Real time of loop run (1us resolution). We use this on the DCM algorithm.
+//Longer than 65ms means the loop was stopped, do not integrate that.
+void Ahrs_set_dt(uint32_t dtUs){
+	if(dtUs > 0xFFFF){
+		dtUs = 0;
+	}
+#if AHRS_FIXED_POINT == 1
+	G_Dt = (dtUs * 4295 + (1UL<<15)) >> 16; // Q16.16 seconds, rounded : 65536 / 1000000 = 4295 / 65536
+#else
+	G_Dt = dtUs * 0.000001;
+#endif
+}
+
+//A transaction with this device failed
+void Ahrs_count_error(uint8_t slaveAddress){
+	if(slaveAddress == gyroAdd){
+		gyroErrors++;
+	}
+	else{
+		accelErrors++;
+	}
+}
+
+//Blocking write, AHRS_TWI_RETRIES tries at most
+//Return 1 if OK, 0 if error
+uint8_t Ahrs_write(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t data){
+	for(uint8_t i = 0 ; i < AHRS_TWI_RETRIES ; i++){
+		if(twiWriteOneByte(slaveAddress, slaveRegister, data)){
+			return 1;
+		}
+		Ahrs_count_error(slaveAddress);
+	}
+	return 0;
+}
+
+//Blocking read, AHRS_TWI_RETRIES tries at most
+//Return 1 if OK, 0 if error
+uint8_t Ahrs_read(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t data[], uint8_t nbBytes){
+	for(uint8_t i = 0 ; i < AHRS_TWI_RETRIES ; i++){
+		if(twiReadMultipleBytes(slaveAddress, slaveRegister, data, nbBytes)){
+			return 1;
+		}
+		Ahrs_count_error(slaveAddress);
+	}
+	return 0;
+}
+
+//Read the gyro, blocking: the last sample, or every stored sample with AHRS_GYRO_FIFO.
+//No sample on error.
+void Gyro_read(){
+#if AHRS_GYRO_FIFO == 1
+	uint8_t fifoSrc;
+	gyroSamples = 0;
+	if(Ahrs_read(gyroAdd, 0x2F, &fifoSrc, 1)){
+		gyroSamples = fifoSrc & 0x1F; //FIFO_SRC, FSS4-0 => stored samples
+	}
+	if(gyroSamples > GYRO_FIFO_SIZE){
+		gyroSamples = GYRO_FIFO_SIZE; //The others are read next time
+	}
+	if((gyroSamples > 0) && !Ahrs_read(gyroAdd, 0x28, ahrsSample.gyro, 6*gyroSamples)){
+		gyroSamples = 0;
+	}
+#else
+	gyroSamples = Ahrs_read(gyroAdd, 0x28, ahrsSample.gyro, 6);
+#endif
+}
+
+//Read the accelerometer, blocking: the last sample, or every stored sample with AHRS_ACCEL_FIFO.
+//No sample on error.
+void Accel_read(){
+#if AHRS_ACCEL_FIFO == 1
+	uint8_t fifoSrc;
+	accelSamples = 0;
+	if(Ahrs_read(accelAdd, 0x2F, &fifoSrc, 1)){
+		accelSamples = fifoSrc & 0x1F; //FIFO_SRC, FSS4-0 => stored samples
+	}
+	if(accelSamples > ACCEL_FIFO_SIZE){
+		accelSamples = ACCEL_FIFO_SIZE; //The others are read next time
+	}
+	if((accelSamples > 0) && !Ahrs_read(accelAdd, 0x28, ahrsSample.accel, 6*accelSamples)){
+		accelSamples = 0;
+	}
+#else
+	accelSamples = Ahrs_read(accelAdd, 0x28, ahrsSample.accel, 6);
+#endif
+}
+
+#if AHRS_TWI_ASYNC == 1
+
+//A sensor read ended (TWI_vect): the last one of a sweep gives its end time
+void Ahrs_read_done(TwiTransaction *transaction){
+	sweepEndUs = clockMicros();
+}
+
+//Sweep received: its time from startUs to the end of the last read
+void Ahrs_sweep_time(uint32_t startUs){
+	uint32_t endUs;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		endUs = sweepEndUs;
+	}
+	ahrsSweepUs = endUs - startUs;
+	if(ahrsSweepUs > ahrsSweepMaxUs){
+		ahrsSweepMaxUs = ahrsSweepUs;
+	}
+}
+
+#if AHRS_GYRO_FIFO == 1
+//FIFO_SRC received (TWI_vect): read the stored samples right after it
+void Gyro_fifo_level(TwiTransaction *transaction){
+	uint8_t samples = 0;
+	
+	if(transaction->status == TWI_DONE){
+		samples = gyroFifoSrc & 0x1F;
+		if(samples > GYRO_FIFO_SIZE){
+			samples = GYRO_FIFO_SIZE;
+		}
+	}
+	
+	if(samples > 0){
+		gyroRead.nbBytes = 6*samples;
+		twiQueue(&gyroRead);
+	}
+	else{
+		gyroRead.status = TWI_IDLE; //Nothing new
+	}
+	
+	Ahrs_read_done(transaction);
 }
+#endif
 
-//Timer 0 overflow. Every 256us.
-ISR(TIMER0_OVF_vect){
-	t0OvfCount++;
+//Queue the gyro read(s), see Gyro_received()
+void Gyro_queue(){
+#if AHRS_GYRO_FIFO == 1
+	twiQueue(&gyroFifoRead);
+#else
+	twiQueue(&gyroRead);
+#endif
 }
 
+//Return 1 while the gyro read(s) queued by Gyro_queue() are not all received
+uint8_t Gyro_pending(){
+#if AHRS_GYRO_FIFO == 1
+	if(gyroFifoRead.status == TWI_PENDING){
+		return 1;
+	}
+#endif
+	return (gyroRead.status == TWI_PENDING);
+}
+
+//Gyro reads received: samples for Ahrs_calculations(), 0 on error
+void Gyro_received(){
+	if(gyroRead.status == TWI_DONE){
+		gyroSamples = gyroRead.nbBytes / 6;
+	}
+	else{
+		gyroSamples = 0;
+	}
+	if(gyroRead.status == TWI_ERROR){
+		gyroErrors++;
+	}
+#if AHRS_GYRO_FIFO == 1
+	if(gyroFifoRead.status == TWI_ERROR){
+		gyroErrors++;
+	}
+#endif
+	gyroRead.status = TWI_IDLE;
+#if AHRS_GYRO_FIFO == 1
+	gyroFifoRead.status = TWI_IDLE;
+#endif
+}
+
+#if AHRS_ACCEL_FIFO == 1
+//FIFO_SRC received (TWI_vect): read the stored samples right after it
+void Accel_fifo_level(TwiTransaction *transaction){
+	uint8_t samples = 0;
+	
+	if(transaction->status == TWI_DONE){
+		samples = accelFifoSrc & 0x1F;
+		if(samples > ACCEL_FIFO_SIZE){
+			samples = ACCEL_FIFO_SIZE;
+		}
+	}
+	
+	if(samples > 0){
+		accelRead.nbBytes = 6*samples;
+		twiQueue(&accelRead);
+	}
+	else{
+		accelRead.status = TWI_IDLE; //Nothing new
+	}
+	
+	Ahrs_read_done(transaction);
+}
+#endif
+
+//Queue the accelerometer read(s), see Accel_received()
+void Accel_queue(){
+#if AHRS_ACCEL_FIFO == 1
+	twiQueue(&accelFifoRead);
+#else
+	twiQueue(&accelRead);
+#endif
+}
+
+//Return 1 while the accelerometer read(s) queued by Accel_queue() are not all received
+uint8_t Accel_pending(){
+#if AHRS_ACCEL_FIFO == 1
+	if(accelFifoRead.status == TWI_PENDING){
+		return 1;
+	}
+#endif
+	return (accelRead.status == TWI_PENDING);
+}
+
+//Accelerometer reads received: samples for Accel_decode(), 0 on error
+void Accel_received(){
+	if(accelRead.status == TWI_DONE){
+		accelSamples = accelRead.nbBytes / 6;
+	}
+	else{
+		accelSamples = 0;
+	}
+	if(accelRead.status == TWI_ERROR){
+		accelErrors++;
+	}
+#if AHRS_ACCEL_FIFO == 1
+	if(accelFifoRead.status == TWI_ERROR){
+		accelErrors++;
+	}
+#endif
+	accelRead.status = TWI_IDLE;
+#if AHRS_ACCEL_FIFO == 1
+	accelFifoRead.status = TWI_IDLE;
+#endif
+}
+
+#endif
+
 void AhrsInit(){
 
 	//Accel initialisation
-	while(twiWriteOneByte(accelAdd, 0x21, 0x18) == 0); //CTRL2 = 0x18 => full scale +/-8g
-	while(twiWriteOneByte(accelAdd, 0x20, 0b01010111) == 0); //CTRL1 = 0b01010111 => 50Hz + 3 axis enable
+	Ahrs_write(accelAdd, 0x21, ACCEL_CTRL2); //CTRL2 => Anti-alias filter, full scale +/-8g
+	Ahrs_write(accelAdd, 0x20, ACCEL_CTRL1); //CTRL1 => Output data rate + 3 axis enable
 	
 	//Magneto initialisation
-	while(twiWriteOneByte(accelAdd, 0x24, 0b01100100) == 0); //CTRL5 = 0b01100100 => High resolution and 6.25Hz
-	while(twiWriteOneByte(accelAdd, 0x25, 0b00100000) == 0); //CTRL6 = 0b00100000 => +-4 gauss
-	while(twiWriteOneByte(accelAdd, 0x26, 0b00000000) == 0); //CTRL7 = 0 => low power off and continuous conversion mode
+	Ahrs_write(accelAdd, 0x24, 0b01101000); //CTRL5 = 0b01101000 => High resolution and 12.5Hz
+	Ahrs_write(accelAdd, 0x25, 0b00100000); //CTRL6 = 0b00100000 => +-4 gauss
+	Ahrs_write(accelAdd, 0x26, 0b00000000); //CTRL7 = 0 => low power off and continuous conversion mode
 	
 	//Gyro initialisation
-	while(twiWriteOneByte(gyroAdd, 0x39, 0b00000000) == 0); //LOW_ODR disabled
-	while(twiWriteOneByte(gyroAdd, 0x23, 0x20) == 0); //CTRL4 = 0x20 => 2000dps full scale
-	while(twiWriteOneByte(gyroAdd, 0x20, 0x0F) == 0); //CTRL1 = 0x0F => Normal power mode, all axis enabled	
+	Ahrs_write(gyroAdd, 0x39, 0b00000000); //LOW_ODR disabled
+	Ahrs_write(gyroAdd, 0x23, 0x20); //CTRL4 = 0x20 => 2000dps full scale
+	Ahrs_write(gyroAdd, 0x20, GYRO_CTRL1); //CTRL1 => Output data rate, normal power mode, all axis enabled	
+	
+#if AHRS_DATA_READY == 1
+#if AHRS_GYRO_FIFO == 1
+	Ahrs_write(gyroAdd, 0x22, 0b00000100); //CTRL3 = 0b00000100 => FIFO watermark on DRDY/INT2
+#else
+	Ahrs_write(gyroAdd, 0x22, 0b00001000); //CTRL3 = 0b00001000 => Data ready on DRDY/INT2
+#endif
+#if AHRS_ACCEL_FIFO == 0
+	Ahrs_write(accelAdd, 0x22, 0b00000100); //CTRL3 = 0b00000100 => Accelerometer data ready on INT1
+#endif
+#endif
 	
 	//Wait for stabilisation
 	_delay_ms(20);
 	
 	//Calculate an average offset of sensors
+	int8_t offsetSamples = 0;
+	int32_t offsetSums[6] = {0, 0, 0, 0, 0, 0};
 	for(int8_t i = 0 ; i < 32 ; i++){
 		
 		int16_t sensorsValues[6];
 		
-		while(twiReadMultipleBytes(gyroAdd, 0x28, gyroSplitedValues, 6) == 0);
-		sensorsValues[0] = ((gyroSplitedValues[1] << 8) | (gyroSplitedValues[0] & 0xff));
-		sensorsValues[1] = ((gyroSplitedValues[3] << 8) | (gyroSplitedValues[2] & 0xff));
-		sensorsValues[2] = ((gyroSplitedValues[5] << 8) | (gyroSplitedValues[4] & 0xff));
+		_delay_ms(20); //Wait for values to be refreshed
 		
-		while(twiReadMultipleBytes(accelAdd, 0x28, accelSplitedValues, 6) == 0);
-		sensorsValues[3] = ((accelSplitedValues[1] << 8) | (accelSplitedValues[0] & 0xff));
-		sensorsValues[4] = ((accelSplitedValues[3] << 8) | (accelSplitedValues[2] & 0xff));
-		sensorsValues[5] = ((accelSplitedValues[5] << 8) | (accelSplitedValues[4] & 0xff));
+		if(!Ahrs_read(gyroAdd, 0x28, ahrsSample.gyro, 6) || !Ahrs_read(accelAdd, 0x28, ahrsSample.accel, 6)){
+			continue; //Skip this sample
+		}
+		offsetSamples++;
+		
+		sensorsValues[0] = ((ahrsSample.gyro[1] << 8) | (ahrsSample.gyro[0] & 0xff));
+		sensorsValues[1] = ((ahrsSample.gyro[3] << 8) | (ahrsSample.gyro[2] & 0xff));
+		sensorsValues[2] = ((ahrsSample.gyro[5] << 8) | (ahrsSample.gyro[4] & 0xff));
+		
+		sensorsValues[3] = ((ahrsSample.accel[1] << 8) | (ahrsSample.accel[0] & 0xff));
+		sensorsValues[4] = ((ahrsSample.accel[3] << 8) | (ahrsSample.accel[2] & 0xff));
+		sensorsValues[5] = ((ahrsSample.accel[5] << 8) | (ahrsSample.accel[4] & 0xff));
 		
 
 		
 		for(int8_t j = 0 ; j < 6 ; j++){
-			AN_OFFSET[j] += sensorsValues[j];
+			offsetSums[j] += sensorsValues[j];
 		}
-		
-		_delay_ms(20); //Wait for values to be refreshed
 	}
 	
-	for(int8_t i = 0 ; i < 6 ; i++){
-		AN_OFFSET[i] = AN_OFFSET[i]/32;
+	for(int8_t i = 0 ; (i < 6) && (offsetSamples > 0) ; i++){
+		AN_OFFSET[i] = offsetSums[i]/offsetSamples;
 	}
 	
-	AN_OFFSET[5]-=GRAVITY*SENSOR_SIGN[5]; //ZEROED the Z accelerometer axis (remove gravity)
+	AN_OFFSET[5]-=GRAVITY*ACCEL_SIGN_Z; //ZEROED the Z accelerometer axis (remove gravity)
+	
+#if AHRS_GYRO_FIFO == 1
+	//FIFO after the offsets, they are computed on single samples
+	Ahrs_write(gyroAdd, 0x2E, 0b01000000 | GYRO_FIFO_WATERMARK); //FIFO_CTRL => Stream mode and watermark
+	Ahrs_write(gyroAdd, 0x24, 0b01000000); //CTRL5 = 0b01000000 => FIFO enabled
+	Ahrs_set_dt(GYRO_SAMPLE_US); //Every sample is integrated on its own
+#endif
+#if AHRS_ACCEL_FIFO == 1
+	Ahrs_write(accelAdd, 0x2E, 0b01000000); //FIFO_CTRL = 0b01000000 => Stream mode
+	Ahrs_write(accelAdd, 0x1F, 0b01000000); //CTRL0 = 0b01000000 => FIFO enabled
+#endif
+	
+#if AHRS_TWI_ASYNC == 1
+	//Reads queued by AhrsCompute(), chained with REPEATED STARTs
+	gyroRead.slaveAddress = gyroAdd;
+	gyroRead.slaveRegister = 0x28;
+	gyroRead.data = ahrsSample.gyro;
+	gyroRead.nbBytes = 6;
+	gyroRead.isRead = 1;
+	gyroRead.repeatedStart = 1;
+	gyroRead.callback = Ahrs_read_done;
+	
+#if AHRS_GYRO_FIFO == 1
+	gyroFifoRead.slaveAddress = gyroAdd;
+	gyroFifoRead.slaveRegister = 0x2F;
+	gyroFifoRead.data = &gyroFifoSrc;
+	gyroFifoRead.nbBytes = 1;
+	gyroFifoRead.isRead = 1;
+	gyroFifoRead.repeatedStart = 1;
+	gyroFifoRead.callback = Gyro_fifo_level;
+#endif
+	
+	accelRead.slaveAddress = accelAdd;
+	accelRead.slaveRegister = 0x28;
+	accelRead.data = ahrsSample.accel;
+	accelRead.nbBytes = 6;
+	accelRead.isRead = 1;
+	accelRead.repeatedStart = 1;
+	accelRead.callback = Ahrs_read_done;
+	
+#if AHRS_ACCEL_FIFO == 1
+	accelFifoRead.slaveAddress = accelAdd;
+	accelFifoRead.slaveRegister = 0x2F;
+	accelFifoRead.data = &accelFifoSrc;
+	accelFifoRead.nbBytes = 1;
+	accelFifoRead.isRead = 1;
+	accelFifoRead.repeatedStart = 1;
+	accelFifoRead.callback = Accel_fifo_level;
+#endif
 	
-	//8-bits Timer 0 configuration
-	TCCR0A = 0; //Normal mode
-	TCCR0B |= 1<<CS01; //Prescaling /8 => 1 tick every us
-	TIMSK0 |= 1<<TOIE0; //Interrup on overflow (every 256us)
+	compassRead.slaveAddress = accelAdd;
+	compassRead.slaveRegister = 0x08;
+	compassRead.data = ahrsSample.compass;
+	compassRead.nbBytes = 6;
+	compassRead.isRead = 1;
+	compassRead.repeatedStart = 1;
+	compassRead.callback = Ahrs_read_done;
+#endif
+	
+#if AHRS_DATA_READY == 1
+	DDRB &= ~(1<<GYRO_DRDY_PIN | 1<<ACCEL_DRDY_PIN); //Inputs
+	drdyHistory = PINB;
+	PCMSK0 |= 1<<GYRO_DRDY_PIN | 1<<ACCEL_DRDY_PIN;
+	PCICR |= 1<<PCIE0; //Enable interrupt of PCINT7:0
+#endif
 	
 }
 
-void AhrsCompute(){
+//Gyro raw bytes (one sample) to offset and sign corrected values
+void Gyro_decode(uint8_t gyroBytes[6]){
+	AN[0] = ((gyroBytes[1] << 8) | (gyroBytes[0] & 0xff));
+	AN[1] = ((gyroBytes[3] << 8) | (gyroBytes[2] & 0xff));
+	AN[2] = ((gyroBytes[5] << 8) | (gyroBytes[4] & 0xff));
+	gyro_x = GYRO_SIGN_X * (AN[0] - AN_OFFSET[0]);
+	gyro_y = GYRO_SIGN_Y * (AN[1] - AN_OFFSET[1]);
+	gyro_z = GYRO_SIGN_Z * (AN[2] - AN_OFFSET[2]);
+}
 
-	//Check if counter overflowed
-	uint8_t actualCount = t0OvfCount;
-	if(actualCount > previousCount){
-		pastCount += actualCount - previousCount;
+//Accelerometer raw bytes to offset and sign corrected values.
+//Several samples are averaged, none keeps the last values.
+void Accel_decode(){
+	if(accelSamples == 0){
+		return;
+	}
+	
+	int32_t sum[3] = {0, 0, 0};
+	for(uint8_t i = 0 ; i < accelSamples ; i++){
+		uint8_t *sample = &ahrsSample.accel[6*i];
+		sum[0] += (int16_t)((sample[1] << 8) | (sample[0] & 0xff));
+		sum[1] += (int16_t)((sample[3] << 8) | (sample[2] & 0xff));
+		sum[2] += (int16_t)((sample[5] << 8) | (sample[4] & 0xff));
+	}
+	AN[3] = sum[0] / accelSamples;
+	AN[4] = sum[1] / accelSamples;
+	AN[5] = sum[2] / accelSamples;
+	accelSamples = 0;
+	
+	accel_x = ACCEL_SIGN_X * (AN[3] - AN_OFFSET[3]);
+	accel_y = ACCEL_SIGN_Y * (AN[4] - AN_OFFSET[4]);
+	accel_z = ACCEL_SIGN_Z * (AN[5] - AN_OFFSET[5]);
+}
+
+//Magnetometer raw bytes to sign corrected values, then heading
+void Compass_decode(uint8_t compassBytes[6]){
+	MAN[0] = ((compassBytes[1] << 8) | (compassBytes[0] & 0xff));
+	MAN[1] = ((compassBytes[3] << 8) | (compassBytes[2] & 0xff));
+	MAN[2] = ((compassBytes[5] << 8) | (compassBytes[4] & 0xff));
+	
+	magnetom_x = MAG_SIGN_X * MAN[0];
+	magnetom_y = MAG_SIGN_Y * MAN[1];
+	magnetom_z = MAG_SIGN_Z * MAN[2];
+	
+	//Calculate magnetic heading
+	Compass_Heading();
+}
+
+//**********************************//
+//Outputs
+//**********************************//
+
+//Gravity direction in body axes, the third DCM line: (-sin(pitch), sin(roll)cos(pitch), cos(roll)cos(pitch)).
+//The tilt terms a controller needs, without trigonometry.
+void AhrsDown(float down[3]){
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		down[i] = DcmToFloat(DCM_Matrix[2][i]);
+	}
+}
+
+//roll, pitch and yaw (radians) of the last DCM iteration, computed by the first call after it
+void AhrsEuler(){
+	if(eulerIteration != ahrsIteration){
+		Euler_angles();
+		eulerIteration = ahrsIteration;
+	}
+}
+
+//DCM iteration on the last decoded values, then outputs
+void Ahrs_calculations(){
+
+	// Calculations
+	for(uint8_t i = 0 ; i < gyroSamples ; i++){
+		Gyro_decode(&ahrsSample.gyro[6*i]);
+		Matrix_update();
+	}
+	gyroSamples = 0;
+	Normalize();
+	Drift_correction();
+	ahrsIteration++; //Euler angles computed again when asked for
+	
+	float down[3];
+	AhrsDown(down);
+	float sinPitch = -down[0];
+	
+	if(sinPitch > 0.0){
+		PORTD |= 1<<PORTD0;
 	}
 	else{
-		pastCount += (256 - previousCount) + actualCount;
+		PORTD &= ~(1<<PORTD0);
+	}
+	
+	int servoValue = 800 + (sinPitch*PITCH_SERVO_GAIN);
+	if(servoValue > 1200){
+		servoValue = 1200;
 	}
+	
+	servo[0] = servoValue;
+}
 
-	previousCount = actualCount;
+#if AHRS_DATA_READY == 1
+//Gyro sample(s) ready at this time: read right away (async TWI) or flag for AhrsPoll().
+//With AHRS_ACCEL_FIFO the accelerometer is read with it. Call it with interrupts disabled.
+void Gyro_ready(uint32_t now){
+	gyroSampleUs = now;
+#if AHRS_TWI_ASYNC == 1
+	Gyro_queue();
+#if AHRS_ACCEL_FIFO == 1
+	Accel_queue();
+#endif
+#else
+	gyroReady = 1;
+#if AHRS_ACCEL_FIFO == 1
+	accelReady = 1;
+#endif
+#endif
+}
 
-	//Run loop at about 50Hz (20ms) => 1 count = 256us => 78 counts = 20ms
-	//**************************
-	//INSTEAD OF THAT, I COULD USE THE PMW GENERATOR TO SYNC THE LOOP AND AVOID AN INTERRUPT
-	//**************************
-	if(pastCount > 78){
-		compassCounter++;
-		
-		G_Dt = (pastCount*256)/1000.0; // Real time of loop run. We use this on the DCM algorithm.
-		G_Dt /= 1000.0;
+//Accelerometer sample ready at this time, as Gyro_ready()
+void Accel_ready(uint32_t now){
+	accelSampleUs = now;
+#if AHRS_TWI_ASYNC == 1
+	Accel_queue();
+#else
+	accelReady = 1;
+#endif
+}
 
-		
-		pastCount = 0;
-		
-		//Read gyro			
-		while(twiReadMultipleBytes(gyroAdd, 0x28, gyroSplitedValues, 6) == 0);
-		AN[0] = ((gyroSplitedValues[1] << 8) | (gyroSplitedValues[0] & 0xff));
-		AN[1] = ((gyroSplitedValues[3] << 8) | (gyroSplitedValues[2] & 0xff));
-		AN[2] = ((gyroSplitedValues[5] << 8) | (gyroSplitedValues[4] & 0xff));
-		gyro_x = SENSOR_SIGN[0] * (AN[0] - AN_OFFSET[0]);
-		gyro_y = SENSOR_SIGN[1] * (AN[1] - AN_OFFSET[1]);
-		gyro_z = SENSOR_SIGN[2] * (AN[2] - AN_OFFSET[2]);
-		
-		//PORTD ^= 1<<PORTD0;
-		
-		/*if(gyro_y > -15000){
-			PORTD |= 1<<PORTD0;
+//Return 1 while the gyro read is queued, or received and not used by AhrsPoll() yet
+//(held for the accelerometer batch with AHRS_ACCEL_FIFO): a new read would overwrite its samples.
+uint8_t Gyro_waiting(){
+#if AHRS_TWI_ASYNC == 1
+	return Gyro_pending() || (gyroRead.status == TWI_DONE);
+#else
+	return gyroReady;
+#endif
+}
+#endif
+
+//**********************************//
+//Scheduler tasks (see monni_scheduler.h)
+//**********************************//
+
+//Gyro and accelerometer, then DCM. Run it at a fixed rate.
+//G_Dt is the real time since the last run (the gyro sample period with AHRS_GYRO_FIFO).
+void AhrsCompute(){
+
+#if AHRS_GYRO_FIFO == 0
+	Ahrs_set_dt(schedulerDt);
+#endif
+
+#if AHRS_TWI_ASYNC == 1
+	twiWatchdog(); //A stuck sweep is aborted, its reads end with TWI_ERROR
+	
+	//Queue the sweep and go back to the main loop, AhrsPoll() runs the DCM when it is received
+	sweepStartUs = clockMicros();
+	Gyro_queue();
+	Accel_queue();
+#if AHRS_DATA_READY == 0
+	sweepCompass = compassDue;
+	compassDue = 0;
+	if(sweepCompass){
+		twiQueue(&compassRead);
+	}
+#endif
+	ahrsReading = 1;
+#else
+	//Read gyro			
+	Gyro_read();
+	
+	//Read accelerometer
+	Accel_read();
+	Accel_decode();
+	
+	Ahrs_calculations();
+	ahrsUpdated = 1;
+#endif
+}
+
+//Magnetometer, then heading. Run it at the magnetometer rate.
+void AhrsCompass(){
+#if AHRS_TWI_ASYNC == 1
+	twiWatchdog(); //Before queuing: a read queued now gets a full period
+#endif
+
+#if AHRS_DATA_READY == 1
+	//No gyro sample for 50ms: no edge came (line never seen high), read anyway.
+	//AhrsPoll() then keeps reading while the lines stay high, the whole FIFO is emptied.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uint32_t now = clockMicros();
+		if((now - gyroSampleUs) > 50000){
+			if(!Gyro_waiting()){
+				Gyro_ready(now);
+			}
+			Accel_ready(now);
 		}
-		else{
-			PORTD = 0;
-		}*/
-		
-		//Read accelerometer
-		while(twiReadMultipleBytes(accelAdd, 0x28, accelSplitedValues, 6) == 0);
-		AN[3] = ((accelSplitedValues[1] << 8) | (accelSplitedValues[0] & 0xff));
-		AN[4] = ((accelSplitedValues[3] << 8) | (accelSplitedValues[2] & 0xff));
-		AN[5] = ((accelSplitedValues[5] << 8) | (accelSplitedValues[4] & 0xff));
-		accel_x = SENSOR_SIGN[3] * (AN[3] - AN_OFFSET[3]);
-		accel_y = SENSOR_SIGN[4] * (AN[4] - AN_OFFSET[4]);
-		accel_z = SENSOR_SIGN[5] * (AN[5] - AN_OFFSET[5]);
-		
-		if(compassCounter > 5){
-			compassCounter = 0;
-			
-			//Read compass
-			while(twiReadMultipleBytes(accelAdd, 0x08, accelSplitedValues, 6) == 0);
-			MAN[0] = ((accelSplitedValues[1] << 8) | (accelSplitedValues[0] & 0xff));
-			MAN[1] = ((accelSplitedValues[3] << 8) | (accelSplitedValues[2] & 0xff));
-			MAN[2] = ((accelSplitedValues[5] << 8) | (accelSplitedValues[4] & 0xff));
-			
-			magnetom_x = SENSOR_SIGN[6] * MAN[0];
-			magnetom_y = SENSOR_SIGN[7] * MAN[1];
-			magnetom_z = SENSOR_SIGN[8] * MAN[2];
-			
-			//Calculate magnetic heading
-			Compass_Heading();				
+	}
+#endif
+
+#if (AHRS_TWI_ASYNC == 1) && (AHRS_DATA_READY == 1)
+	twiQueue(&compassRead); //Decoded by AhrsPoll()
+#elif AHRS_TWI_ASYNC == 1
+	compassDue = 1; //Read by the next sweep, decoded by AhrsPoll()
+#else
+	if(Ahrs_read(accelAdd, 0x08, ahrsSample.compass, 6)){
+		Compass_decode(ahrsSample.compass);
+	}
+#endif
+}
+
+#if AHRS_DATA_READY == 1
+
+//Sensors data ready: timestamp and read
+ISR(PCINT0_vect){
+
+	uint32_t now = clockMicros();
+	uint8_t pinState = PINB;
+	uint8_t risingBits = pinState & ~drdyHistory;
+	drdyHistory = pinState;
+	
+	if(risingBits & (1<<GYRO_DRDY_PIN)){
+		Gyro_ready(now);
+	}
+	
+	if(risingBits & (1<<ACCEL_DRDY_PIN)){
+		Accel_ready(now);
+	}
+}
+
+//A line still high once its reads are done gives no new edge: the gyro FIFO is still at its watermark
+//(GYRO_FIFO_SIZE samples per read at most) or a read failed. Read again until the line falls.
+void Ahrs_ready_check(){
+	uint8_t pinState = PINB;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if((pinState & (1<<GYRO_DRDY_PIN)) && !Gyro_waiting()){
+			Gyro_ready(clockMicros());
 		}
-		
-		// Calculations
-		Matrix_update(); 	
-		Normalize();
-		Drift_correction();
-		Euler_angles();
-		
-		float pitchOk = ToDeg(pitch);
-		
-		if(pitchOk > 0.0){
-			PORTD |= 1<<PORTD0;
+#if AHRS_ACCEL_FIFO == 0
+#if AHRS_TWI_ASYNC == 1
+		if((pinState & (1<<ACCEL_DRDY_PIN)) && !Accel_pending()){
+#else
+		if((pinState & (1<<ACCEL_DRDY_PIN)) && !accelReady){
+#endif
+			Accel_ready(clockMicros());
 		}
-		else{
-			PORTD = 0;
+#endif
+	}
+}
+
+//Decode the samples read since the last call, DCM on each new gyro sample.
+//Call it as often as possible (from the main loop).
+void AhrsPoll(){
+
+#if AHRS_TWI_ASYNC == 1
+	if(compassRead.status == TWI_DONE){
+		Compass_decode(ahrsSample.compass);
+	}
+	else if(compassRead.status == TWI_ERROR){
+		accelErrors++;
+	}
+	if(compassRead.status != TWI_PENDING){
+		compassRead.status = TWI_IDLE;
+	}
+	
+	uint8_t accelDone = !Accel_pending();
+	if(accelDone){
+		Accel_received();
+		Accel_decode();
+	}
+	
+#if AHRS_ACCEL_FIFO == 1
+	//The accelerometer is read after the gyro (same edge): its samples go with the gyro ones
+	if(!Gyro_pending() && accelDone && (gyroRead.status == TWI_DONE)){
+#else
+	if(!Gyro_pending() && (gyroRead.status == TWI_DONE)){
+#endif
+		Gyro_received();
+		
+		uint32_t readyUs;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			readyUs = gyroSampleUs;
 		}
+		Ahrs_sweep_time(readyUs); //From the gyro data ready edge
+#else
+	if(accelReady){
+		accelReady = 0;
+		Accel_read();
+		Accel_decode();
+	}
+	
+	if(gyroReady){
+		gyroReady = 0;
+		Gyro_read();
+#endif
 		
-		int servoValue = 800 + (pitchOk*10);
-		if(servoValue > 1200){
-			servoValue = 1200;
+#if AHRS_GYRO_FIFO == 0
+		uint32_t sampleUs;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			sampleUs = gyroSampleUs;
 		}
+		Ahrs_set_dt(sampleUs - lastGyroSampleUs); //Time between the two samples, not between two reads
+		lastGyroSampleUs = sampleUs;
+#endif
 		
-		servo[0] = servoValue;
+		Ahrs_calculations();
+		ahrsUpdated = 1;
+	}
+#if AHRS_TWI_ASYNC == 1
+	else if(!Gyro_pending() && (gyroRead.status != TWI_DONE)){
+		Gyro_received(); //Error or empty FIFO
+	}
+#endif
+	
+	Ahrs_ready_check();
+}
 
+#elif AHRS_TWI_ASYNC == 1
+//Use the reads queued by AhrsCompute() and AhrsCompass() once received.
+//Call it as often as possible (from the main loop).
+void AhrsPoll(){
+
+	if(compassRead.status == TWI_DONE){
+		Compass_decode(ahrsSample.compass);
+	}
+	else if(compassRead.status == TWI_ERROR){
+		accelErrors++;
+	}
+	if(compassRead.status != TWI_PENDING){
+		compassRead.status = TWI_IDLE;
 	}
 
+	//Sweep of the last AhrsCompute() completely received: run the DCM on it
+	if(ahrsReading && !Gyro_pending() && !Accel_pending() && !(sweepCompass && (compassRead.status == TWI_PENDING))){
+		ahrsReading = 0;
+		Ahrs_sweep_time(sweepStartUs);
+		
+		Gyro_received();
+		Accel_received();
+		Accel_decode();
+		
+		Ahrs_calculations();
+		ahrsUpdated = 1;
+	}
 }
+#endif
 
-#endif
\ No newline at end of file
+#endif
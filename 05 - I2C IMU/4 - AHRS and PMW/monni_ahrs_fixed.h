@@ -0,0 +1,198 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Fixed point (Q16.16) DCM. Included by monni_ahrs.h when AHRS_FIXED_POINT is 1.
+//Same functions and variables names as the float DCM, only the types change.
+//No float operation is done in Matrix_update(), Normalize() and Drift_correction().
+//Compass_Heading() (once per magnetometer reading) and Euler_angles() (on demand) stay in float.
+//*****************************************
+
+#ifndef MONNI_AHRS_FIXED
+#define MONNI_AHRS_FIXED
+
+#include "monni_fixed.h"
+
+//Gyro raw data to rad/s in Q16.16 : 0.07 dps/digit = 0.00122173 rad/s/digit.
+//The scale is kept in Q8.24 (20498) to stay accurate, then shifted back to Q16.16.
+#define GYRO_SCALE_Q24 ((int32_t)(ToRad(Gyro_Gain_X)*16777216.0 + 0.5))
+#define Gyro_Scaled_Q16(x) (((int32_t)(x) * GYRO_SCALE_Q24) >> 8)
+
+//Accelerometer raw data to g in Q16.16 (1g = GRAVITY = 4096 = 65536 / 16)
+#define Accel_Scaled_Q16(x) ((q16_t)(x) * 16)
+
+//DCM element as a float (Compass_Heading())
+#define DcmToFloat(x) Q16ToFloat(x)
+
+//Gains. Accel_Vector is expressed in g instead of raw values so the roll/pitch gains
+//are multiplied by GRAVITY to behave exactly like the float DCM.
+//Integrators are kept in Q8.24 because Ki * error is most of the time below 1 LSB in Q16.16.
+#define KP_ROLLPITCH_Q16 ToQ16(Kp_ROLLPITCH*4096)
+#define KI_ROLLPITCH_Q24 ((int32_t)(Ki_ROLLPITCH*4096*16777216.0 + 0.5))
+#define KP_YAW_Q16 ToQ16(Kp_YAW)
+#define KI_YAW_Q24 ((int32_t)(Ki_YAW*16777216.0 + 0.5))
+
+#define NORMALIZE_THRESHOLD_Q16 ToQ16(NORMALIZE_THRESHOLD)
+
+//Integration time in seconds (Q16.16)
+q16_t G_Dt = ToQ16(0.02);
+
+q16_t Accel_Vector[3]= {0,0,0}; //Store the acceleration in a vector (g)
+q16_t Gyro_Vector[3]= {0,0,0};//Store the gyros turn rate in a vector (rad/s)
+q16_t Omega_Vector[3]= {0,0,0}; //Corrected Gyro_Vector data
+q16_t Omega_P[3]= {0,0,0};//Omega Proportional correction
+q16_t Omega_I[3]= {0,0,0};//Omega Integrator (Q8.24)
+q16_t Omega[3]= {0,0,0};
+
+q16_t errorRollPitch[3]= {0,0,0};
+q16_t errorYaw[3]= {0,0,0};
+
+//Magnetic heading as a unit vector, updated by Compass_Heading() only
+q15_t mag_heading_x = Q15_MAX;
+q15_t mag_heading_y = 0;
+
+q16_t DCM_Matrix[3][3]= {
+	{Q16_ONE, 0, 0},
+	{0, Q16_ONE, 0},
+	{0, 0, Q16_ONE}
+};
+
+//**********************************//
+//MATRIX Calculations
+//**********************************//
+
+//Computes the dot product of two vectors
+q16_t Vector_Dot_Product(q16_t vector1[3], q16_t vector2[3]){
+	q16_t op = 0;
+
+	for(uint8_t c = 0 ; c < 3 ; c++){
+		op = q16Add(op, q16Mul(vector1[c], vector2[c]));
+	}
+
+	return op;
+}
+
+//Computes the cross product of two vectors
+void Vector_Cross_Product(q16_t vectorOut[3], q16_t v1[3], q16_t v2[3]){
+	vectorOut[0] = q16Sub(q16Mul(v1[1], v2[2]), q16Mul(v1[2], v2[1]));
+	vectorOut[1] = q16Sub(q16Mul(v1[2], v2[0]), q16Mul(v1[0], v2[2]));
+	vectorOut[2] = q16Sub(q16Mul(v1[0], v2[1]), q16Mul(v1[1], v2[0]));
+}
+
+//Multiply the vector by a scalar.
+void Vector_Scale(q16_t vectorOut[3], q16_t vectorIn[3], q16_t scale2){
+	for(uint8_t c = 0 ; c < 3 ; c++){
+		vectorOut[c] = q16Mul(vectorIn[c], scale2);
+	}
+}
+
+void Vector_Add(q16_t vectorOut[3], q16_t vectorIn1[3], q16_t vectorIn2[3]){
+	for(uint8_t c = 0 ; c < 3 ; c++){
+		vectorOut[c] = q16Add(vectorIn1[c], vectorIn2[c]);
+	}
+}
+
+void Normalize(void){
+	q16_t error = 0;
+	q16_t temporary[3][3];
+	q16_t renorm = 0;
+
+	error = -(Vector_Dot_Product(&DCM_Matrix[0][0], &DCM_Matrix[1][0]) / 2); //eq.19
+
+	//Orthonormal enough: skip the renormalization (see NORMALIZE_THRESHOLD)
+	if((2*labs(error) + labs(Q16_ONE - Vector_Dot_Product(&DCM_Matrix[2][0], &DCM_Matrix[2][0])) < NORMALIZE_THRESHOLD_Q16)
+		&& (++normalizeSkipped < NORMALIZE_EVERY)){
+		return;
+	}
+	normalizeSkipped = 0;
+	ahrsRenormalizations++;
+
+	Vector_Scale(&temporary[0][0], &DCM_Matrix[1][0], error); //eq.19
+	Vector_Scale(&temporary[1][0], &DCM_Matrix[0][0], error); //eq.19
+
+	Vector_Add(&temporary[0][0], &temporary[0][0], &DCM_Matrix[0][0]); //eq.19
+	Vector_Add(&temporary[1][0], &temporary[1][0], &DCM_Matrix[1][0]); //eq.19
+
+	Vector_Cross_Product(&temporary[2][0], &temporary[0][0], &temporary[1][0]); // c= a x b //eq.20
+
+	//eq.21 : renorm = .5 * (3 - dot)
+	for(uint8_t i = 0 ; i < 3 ; i++){
+		renorm = q16Sub(3*Q16_ONE, Vector_Dot_Product(&temporary[i][0], &temporary[i][0])) / 2;
+		Vector_Scale(&DCM_Matrix[i][0], &temporary[i][0], renorm);
+	}
+}
+
+/**************************************************/
+void Drift_correction(void){
+	q16_t errorCourse;
+	//Compensation the Roll, Pitch and Yaw drift.
+	static q16_t Scaled_Omega_P[3];
+	static q16_t Scaled_Omega_I[3];
+	q16_t Accel_weight;
+
+	//*****Roll and Pitch***************
+
+	// Dynamic weighting of accelerometer info (reliability filter)
+	// Weight for accelerometer info (<0.5G = 0.0, 1G = 1.0 , >1.5G = 0.0)
+	Accel_weight = (q16_t)Accel_weight_q15() << 1; //Q15 => Q16.16
+
+	Vector_Cross_Product(&errorRollPitch[0], &Accel_Vector[0], &DCM_Matrix[2][0]); //adjust the ground of reference
+	Vector_Scale(&Omega_P[0], &errorRollPitch[0], q16Mul(KP_ROLLPITCH_Q16, Accel_weight));
+
+	Vector_Scale(&Scaled_Omega_I[0], &errorRollPitch[0], q16Mul(KI_ROLLPITCH_Q24, Accel_weight)); //Q8.24
+	Vector_Add(Omega_I, Omega_I, Scaled_Omega_I);
+
+	//*****YAW***************
+	// We make the gyro YAW drift correction based on compass magnetic heading
+
+	errorCourse = q16Sub(q16MulQ15(DCM_Matrix[0][0], mag_heading_y), q16MulQ15(DCM_Matrix[1][0], mag_heading_x)); //Calculating YAW error
+	Vector_Scale(errorYaw, &DCM_Matrix[2][0], errorCourse); //Applys the yaw correction to the XYZ rotation of the aircraft, depeding the position.
+
+	Vector_Scale(&Scaled_Omega_P[0], &errorYaw[0], KP_YAW_Q16); //.01proportional of YAW.
+	Vector_Add(Omega_P, Omega_P, Scaled_Omega_P); //Adding  Proportional.
+
+	Vector_Scale(&Scaled_Omega_I[0], &errorYaw[0], KI_YAW_Q24); //.00001Integrator (Q8.24)
+	Vector_Add(Omega_I, Omega_I, Scaled_Omega_I); //adding integrator to the Omega_I
+}
+
+void Matrix_update(void){
+	Gyro_Vector[0] = Gyro_Scaled_Q16(gyro_x); //gyro x roll
+	Gyro_Vector[1] = Gyro_Scaled_Q16(gyro_y); //gyro y pitch
+	Gyro_Vector[2] = Gyro_Scaled_Q16(gyro_z); //gyro Z yaw
+
+	Accel_Vector[0] = Accel_Scaled_Q16(accel_x);
+	Accel_Vector[1] = Accel_Scaled_Q16(accel_y);
+	Accel_Vector[2] = Accel_Scaled_Q16(accel_z);
+
+	for(uint8_t c = 0 ; c < 3 ; c++){
+		Omega[c] = q16Add(Gyro_Vector[c], Omega_I[c] / 256); //adding integrator term (Q8.24 => Q16.16)
+	}
+	Vector_Add(&Omega_Vector[0], &Omega[0], &Omega_P[0]); //adding proportional term
+
+ #if OUTPUTMODE==1
+	q16_t *w = Omega_Vector;
+ #else // Uncorrected data (no drift correction)
+	q16_t *w = Gyro_Vector;
+ #endif
+
+	q16_t theta[3]; //Rotation of this sample (rad)
+	Vector_Scale(theta, w, G_Dt);
+
+	//DCM = DCM + DCM*[theta x], one cross product per line (see the float Matrix_update())
+	for(uint8_t x = 0 ; x < 3 ; x++){
+		q16_t a = DCM_Matrix[x][0];
+		q16_t b = DCM_Matrix[x][1];
+		q16_t c = DCM_Matrix[x][2];
+		DCM_Matrix[x][0] = q16Add(a, q16Sub(q16Mul(b, theta[2]), q16Mul(c, theta[1])));
+		DCM_Matrix[x][1] = q16Add(b, q16Sub(q16Mul(c, theta[0]), q16Mul(a, theta[2])));
+		DCM_Matrix[x][2] = q16Add(c, q16Sub(q16Mul(a, theta[1]), q16Mul(b, theta[0])));
+	}
+}
+
+//Euler angles stay in float so the outputs are the same as the float DCM
+void Euler_angles(void){
+	pitch = -asin(Q16ToFloat(DCM_Matrix[2][0]));
+	roll = atan2(DCM_Matrix[2][1], DCM_Matrix[2][2]);
+	yaw = atan2(DCM_Matrix[1][0], DCM_Matrix[0][0]);
+}
+
+#endif
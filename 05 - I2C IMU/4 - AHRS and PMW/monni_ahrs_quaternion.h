@@ -0,0 +1,86 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Quaternion attitude (Mahony). Included by monni_ahrs.h when AHRS_QUATERNION is 1,
+//in place of the float Matrix_update() and Normalize().
+//The attitude is integrated on a 4 values quaternion instead of the 3x3 DCM
+//(12 multiplies per gyro sample instead of 27 + 9), normalized once per iteration,
+//then written to DCM_Matrix: Drift_correction() (same Kp/Ki correction) and
+//Euler_angles() read it unchanged.
+//*****************************************
+
+#ifndef MONNI_AHRS_QUATERNION
+#define MONNI_AHRS_QUATERNION
+
+//Body to earth rotation, w x y z
+float Quaternion[4] = {1, 0, 0, 0};
+
+//Rotation matrix of the quaternion (DCM_Matrix is only written here)
+void Quaternion_to_dcm(void){
+	float ww = Quaternion[0]*Quaternion[0];
+	float xx = Quaternion[1]*Quaternion[1];
+	float yy = Quaternion[2]*Quaternion[2];
+	float zz = Quaternion[3]*Quaternion[3];
+	float wx = Quaternion[0]*Quaternion[1];
+	float wy = Quaternion[0]*Quaternion[2];
+	float wz = Quaternion[0]*Quaternion[3];
+	float xy = Quaternion[1]*Quaternion[2];
+	float xz = Quaternion[1]*Quaternion[3];
+	float yz = Quaternion[2]*Quaternion[3];
+
+	DCM_Matrix[0][0] = ww + xx - yy - zz;
+	DCM_Matrix[0][1] = 2*(xy - wz);
+	DCM_Matrix[0][2] = 2*(xz + wy);
+	DCM_Matrix[1][0] = 2*(xy + wz);
+	DCM_Matrix[1][1] = ww - xx + yy - zz;
+	DCM_Matrix[1][2] = 2*(yz - wx);
+	DCM_Matrix[2][0] = 2*(xz - wy);
+	DCM_Matrix[2][1] = 2*(yz + wx);
+	DCM_Matrix[2][2] = ww - xx - yy + zz;
+}
+
+//Quaternion back to unit length at every iteration, then DCM_Matrix.
+//The norm stays close to 1 between two iterations: 1/sqrt(n) ~ (3 - n)/2 as eq.21 of the DCM.
+void Normalize(void){
+	float renorm = .5 *(3 - (Quaternion[0]*Quaternion[0] + Quaternion[1]*Quaternion[1] + Quaternion[2]*Quaternion[2] + Quaternion[3]*Quaternion[3]));
+
+	for(uint8_t i = 0 ; i < 4 ; i++){
+		Quaternion[i] *= renorm;
+	}
+	ahrsRenormalizations++; //Always: the quaternion renormalization is cheaper than its check
+
+	Quaternion_to_dcm();
+}
+
+//q = q + q * (0, Omega_Vector * G_Dt / 2)
+void Matrix_update(void){
+	Gyro_Vector[0]=Gyro_Scaled_X(gyro_x); //gyro x roll
+	Gyro_Vector[1]=Gyro_Scaled_Y(gyro_y); //gyro y pitch
+	Gyro_Vector[2]=Gyro_Scaled_Z(gyro_z); //gyro Z yaw
+
+	Accel_Vector[0]=accel_x;
+	Accel_Vector[1]=accel_y;
+	Accel_Vector[2]=accel_z;
+
+	Vector_Add(&Omega[0], &Gyro_Vector[0], &Omega_I[0]); //adding Integrator term
+	Vector_Add(&Omega_Vector[0], &Omega[0], &Omega_P[0]); //adding proportional term
+
+	float half[3];
+#if OUTPUTMODE==1
+	Vector_Scale(half, Omega_Vector, .5*G_Dt);
+#else //Uncorrected data (no drift correction)
+	Vector_Scale(half, Gyro_Vector, .5*G_Dt);
+#endif
+
+	float w = Quaternion[0];
+	float x = Quaternion[1];
+	float y = Quaternion[2];
+	float z = Quaternion[3];
+
+	Quaternion[0] += -x*half[0] - y*half[1] - z*half[2];
+	Quaternion[1] += w*half[0] + y*half[2] - z*half[1];
+	Quaternion[2] += w*half[1] - x*half[2] + z*half[0];
+	Quaternion[3] += w*half[2] + x*half[1] - y*half[0];
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include "monni_clock.h"
+
+volatile uint32_t clockOverflows = 0;
+volatile uint32_t clockMs = 0; //Milliseconds at the last overflow
+volatile uint16_t clockRemainingUs = 0; //And the microseconds left over
+
+uint8_t clockTicksShift = 0;
+
+//Duration of an overflow, split in ms and remaining us
+uint16_t clockOverflowMs = 65;
+uint16_t clockOverflowRemainingUs = 536;
+
+//Timer 1 overflow (every 65.536ms, or 8.192ms without prescaler)
+ISR(TIMER1_OVF_vect){
+	clockOverflows++;
+	clockMs += clockOverflowMs;
+	clockRemainingUs += clockOverflowRemainingUs;
+	if(clockRemainingUs >= 1000){
+		clockRemainingUs -= 1000;
+		clockMs++;
+	}
+}
+
+//Enable the Timer 1 overflow interrupt
+void clockInit(uint8_t ticksShift){
+	clockTicksShift = ticksShift;
+	clockOverflowMs = (65536UL >> ticksShift) / 1000;
+	clockOverflowRemainingUs = (65536UL >> ticksShift) % 1000;
+
+	TIFR1 = 1<<TOV1; //Clear an old overflow
+	TIMSK1 |= 1<<TOIE1;
+}
+
+//Microseconds since clockInit(), 1us resolution
+uint32_t clockMicros(){
+
+	uint32_t overflows;
+	uint16_t ticks;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		overflows = clockOverflows;
+		ticks = TCNT1;
+		//TCNT1 wrapped but the interrupt did not run yet
+		if((TIFR1 & (1<<TOV1)) && (ticks < 0x8000)){
+			overflows++;
+		}
+	}
+
+	return (overflows << (16 - clockTicksShift)) + (ticks >> clockTicksShift);
+}
+
+//Milliseconds since clockInit()
+uint32_t clockMillis(){
+
+	uint32_t ms;
+	uint32_t us;
+	uint16_t ticks;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		ms = clockMs;
+		us = clockRemainingUs;
+		ticks = TCNT1;
+		//TCNT1 wrapped but the interrupt did not run yet
+		if((TIFR1 & (1<<TOV1)) && (ticks < 0x8000)){
+			ms += clockOverflowMs;
+			us += clockOverflowRemainingUs;
+		}
+	}
+
+	return ms + (us + (ticks >> clockTicksShift)) / 1000;
+}
@@ -0,0 +1,25 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Program time from Timer 1 (shared with the PMW generation).
+//TCNT1 is extended with an overflow counter to a 32 bits microseconds clock
+//(wraps every 71 minutes) and a 32 bits milliseconds clock (49 days).
+//Timer 1 prescaler is set by the PMW code, not here.
+//*****************************************
+
+#ifndef MONNI_CLOCK
+#define MONNI_CLOCK
+
+#include "monni_hal.h"
+
+//Enable the Timer 1 overflow interrupt.
+//ticksShift : log2 of the Timer 1 ticks per microsecond (0 with a prescaler of 8 at 8MHz, 3 without prescaler)
+void clockInit(uint8_t ticksShift);
+
+//Microseconds since clockInit(), 1us resolution. Can be called with interrupts disabled.
+uint32_t clockMicros();
+
+//Milliseconds since clockInit(). Can be called with interrupts disabled.
+uint32_t clockMillis();
+
+#endif
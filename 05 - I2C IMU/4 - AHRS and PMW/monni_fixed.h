@@ -0,0 +1,110 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Fixed point arithmetic for the ATmega328p (no FPU).
+//Q16.16 (q16_t) : 32 bits, 1.0 = 65536, range +/-32768.
+//Q1.15 (q15_t) : 16 bits, 1.0 = 32768, range [-1, 1[.
+//Every operation saturates instead of wrapping around.
+//*****************************************
+
+#ifndef MONNI_FIXED
+#define MONNI_FIXED
+
+#include <stdint.h>
+
+typedef int32_t q16_t;
+typedef int16_t q15_t;
+
+#define Q16_ONE 65536L
+#define Q16_MAX INT32_MAX
+#define Q16_MIN INT32_MIN
+#define Q15_ONE 32768L
+#define Q15_MAX INT16_MAX
+#define Q15_MIN INT16_MIN
+
+//Conversions from constant expressions. Evaluated by the compiler, never at run time.
+#define ToQ16(x) ((q16_t)((x)*65536.0 + (((x) >= 0) ? 0.5 : -0.5)))
+#define ToQ15(x) ((q15_t)(((x) >= 1.0) ? Q15_MAX : ((x)*32768.0 + (((x) >= 0) ? 0.5 : -0.5))))
+
+//Conversions to float (debug or output only, never in the hot loop)
+#define Q16ToFloat(x) ((float)(x) / 65536.0f)
+
+//Run time conversion of a float to a Q1.15, saturated (outside the hot loop)
+static inline q15_t floatToQ15(float x){
+	if(x >= 1.0f){
+		return Q15_MAX;
+	}
+	else if(x <= -1.0f){
+		return Q15_MIN;
+	}
+
+	return (q15_t)(x * 32768.0f + ((x >= 0) ? 0.5f : -0.5f));
+}
+
+//Saturated addition
+static inline q16_t q16Add(q16_t a, q16_t b){
+	q16_t result = (q16_t)((uint32_t)a + (uint32_t)b);
+
+	//Overflow only if both operands have the same sign and the result has not
+	if(!((a ^ b) & 0x80000000UL) && ((a ^ result) & 0x80000000UL)){
+		return (a < 0) ? Q16_MIN : Q16_MAX;
+	}
+
+	return result;
+}
+
+//Saturated subtraction
+static inline q16_t q16Sub(q16_t a, q16_t b){
+	q16_t result = (q16_t)((uint32_t)a - (uint32_t)b);
+
+	//Overflow only if operands have different signs and the result has not the sign of a
+	if(((a ^ b) & 0x80000000UL) && ((a ^ result) & 0x80000000UL)){
+		return (a < 0) ? Q16_MIN : Q16_MAX;
+	}
+
+	return result;
+}
+
+//Saturated multiplication.
+//Split in 16 bits halves so avr-gcc only uses its 16x16=>32 bits multiplications
+//and 32 bits additions (a*b>>16 = ah*bh<<16 + ah*bl + al*bh + al*bl>>16).
+//The low halves of the cross terms and al*bl>>16 give the fraction and a carry,
+//the integer part (ah*bh, high halves and carry) can not overflow 32 bits:
+//the result fits when it is within the 16 bits range.
+static inline q16_t q16Mul(q16_t a, q16_t b){
+	int16_t ah = a >> 16;
+	uint16_t al = a & 0xFFFF;
+	int16_t bh = b >> 16;
+	uint16_t bl = b & 0xFFFF;
+
+	int32_t crossA = (int32_t)ah * bl;
+	int32_t crossB = (int32_t)al * bh;
+
+	uint32_t fraction = (uint32_t)(uint16_t)crossA + (uint16_t)crossB + (((uint32_t)al * bl) >> 16);
+	int32_t integer = (int32_t)ah * bh + (crossA >> 16) + (crossB >> 16) + (int16_t)(fraction >> 16);
+
+	if(integer > 32767){
+		return Q16_MAX;
+	}
+	else if(integer < -32768){
+		return Q16_MIN;
+	}
+
+	return (q16_t)(((uint32_t)integer << 16) | (uint16_t)fraction);
+}
+
+//Multiply a Q16.16 by a Q1.15 and return a Q16.16.
+//Cheaper than q16Mul() (two 16x16 multiplications only). |result| < |a| except for b = -1,
+//done as a saturated negation (-1 * Q16_MIN does not fit).
+static inline q16_t q16MulQ15(q16_t a, q15_t b){
+	int16_t ah = a >> 16;
+	uint16_t al = a & 0xFFFF;
+
+	if(b == Q15_MIN){
+		return (a == Q16_MIN) ? Q16_MAX : -a;
+	}
+
+	return ((int32_t)ah * b * 2) + (((int32_t)al * b) >> 15);
+}
+
+#endif
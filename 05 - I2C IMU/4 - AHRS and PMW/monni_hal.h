@@ -0,0 +1,34 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Hardware abstraction. The flight code includes this file, not the avr-libc headers.
+//The hardware is used through the ATmega328p registers (ports, Timer 1, TWI, pin change
+//interrupts) and the avr-libc ISR(), sei()/cli(), ATOMIC_BLOCK and _delay macros.
+//Two backends of these names:
+//- AVR (avr-gcc, Makefile) : avr-libc.
+//- Host (HAL_HOST defined, host/Makefile) : host/avr and host/util on a simulated
+//  ATmega328p (host/host_avr.c), main.c builds as a Linux executable.
+//halIdle() ends each main loop pass : nothing on the MCU, the simulated time goes on
+//in the host build.
+//*****************************************
+
+#ifndef MONNI_HAL
+#define MONNI_HAL
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#ifdef HAL_HOST
+#include "host_avr.h"
+#define halIdle() hostIdle()
+#else
+#define halIdle()
+#endif
+
+#endif
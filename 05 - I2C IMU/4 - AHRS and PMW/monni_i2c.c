@@ -1,8 +1,18 @@
 #include "monni_i2c.h"
 
-//Wait for the interrupt flag to be set
-void twiWaitFlag(){
-	while(!(TWCR & (1<<TWINT)));
+//Last error of a blocking function, see TWI_ERR_xxx
+uint8_t twiLastError = TWI_ERR_NONE;
+
+//Wait for the interrupt flag to be set, TWI_TIMEOUT_LOOPS at most
+//Return 1 if set, 0 on timeout
+uint8_t twiWaitFlag(){
+	uint16_t loops = TWI_TIMEOUT_LOOPS;
+	while(!(TWCR & (1<<TWINT))){
+		if(--loops == 0){
+			return 0;
+		}
+	}
+	return 1;
 }
 
 //Get status code
@@ -17,93 +27,371 @@ void twiWriteByte(uint8_t byte){
 	TWCR = 1<<TWINT | 1<<TWEN;
 }
 
+//Error code of an unexpected status code
+uint8_t twiStatusError(uint8_t status){
+	switch(status){
+		case 0x20: //SLA+W, NACK
+		case 0x48: //SLA+R, NACK
+			return TWI_ERR_NACK_ADDRESS;
+		case 0x30: //Data, NACK
+			return TWI_ERR_NACK_DATA;
+		case 0x38:
+			return TWI_ERR_ARBITRATION;
+		case 0x00:
+			return TWI_ERR_BUS;
+		case 0xF8: //No TWINT, see twiInit()
+			return TWI_ERR_TIMEOUT;
+		default:
+			return TWI_ERR_BUS;
+	}
+}
+
+//End a blocking transaction (STOP), the bus is free for the next START.
+//status : last status code, recorded in twiLastError if it is not expected
+//Return 1 if OK, 0 if error
+uint8_t twiEnd(uint8_t status, uint8_t expectedStatus){
+	
+	if(status == expectedStatus){
+		twiLastError = TWI_ERR_NONE;
+	}
+	else{
+		twiLastError = twiStatusError(status);
+	}
+	
+	if(twiLastError == TWI_ERR_TIMEOUT){
+		twiRecover();
+	}
+	else{
+		TWCR = 1<<TWINT | 1<<TWSTO | 1<<TWEN;
+		//The STOP does not set TWINT, TWSTO is cleared once it is sent
+		uint16_t loops = TWI_TIMEOUT_LOOPS;
+		while((TWCR & (1<<TWSTO)) && (--loops > 0));
+	}
+	
+	return (twiLastError == TWI_ERR_NONE);
+}
+
+//Free a slave holding SDA low (reset in the middle of a read, lost clock) : up to 9 SCL
+//pulses until it releases SDA, then a STOP. TWI is disabled meanwhile, then enabled again.
+void twiRecover(){
+	
+	uint8_t pullUps = PORTC & (1<<PORTC4 | 1<<PORTC5);
+	
+	TWCR = 0; //TWI off, PC4 (SDA) and PC5 (SCL) are back to PORTC
+	PORTC &= ~(1<<PORTC4 | 1<<PORTC5); //Open drain : low as output, released as input
+	DDRC &= ~(1<<DDC4 | 1<<DDC5);
+	
+	for(uint8_t i = 0 ; (i < 9) && !(PINC & (1<<PINC4)) ; i++){
+		DDRC |= 1<<DDC5; //SCL low
+		_delay_us(5);
+		DDRC &= ~(1<<DDC5); //SCL released
+		_delay_us(5);
+	}
+	
+	//STOP : SDA released while SCL is high
+	DDRC |= 1<<DDC5; //SCL low
+	_delay_us(5);
+	DDRC |= 1<<DDC4; //SDA low
+	_delay_us(5);
+	DDRC &= ~(1<<DDC5); //SCL released
+	_delay_us(5);
+	DDRC &= ~(1<<DDC4); //SDA released
+	_delay_us(5);
+	
+	PORTC |= pullUps;
+	TWCR = 1<<TWEN; //Same bit rate, TWBR and TWSR are kept
+}
+
 //Initialize a TWI communication sending a Start and SLA+R/W
-//Return the status code
+//Return the status code, 0xF8 if the bus did not answer in time
 uint8_t twiInit(uint8_t slaveAddress, uint8_t isRead){
 	//Send a (RE)START
 	TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
-	while(!(TWCR & (1<<TWINT)));
+	if(!twiWaitFlag()){
+		return 0xF8;
+	}
 	if((twiGetStatus() == 0x08) || (twiGetStatus() == 0x10)){
 		TWDR = ((slaveAddress << 1) | isRead);
 		TWCR = 1<<TWINT | 1<<TWEN;
+		if(!twiWaitFlag()){
+			return 0xF8;
+		}
 	}
-	while(!(TWCR & (1<<TWINT)));
 	
 	return (TWSR & 0xF8);
 }
 
-//Write only one byte
-//Return 1 if OK, 0 if error
-uint8_t twiWriteOneByte(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t data){
+//Send SLA+W and the register, then, to read, a REPEATED START and SLA+R
+//Return the last status code (0x28 to write, 0x40 to read when OK)
+uint8_t twiSelectRegister(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t isRead){
 	
-	if(twiInit(slaveAddress, 0) == 0x18){
+	uint8_t status = twiInit(slaveAddress, 0);
+	
+	if(status == 0x18){
 		twiWriteByte(slaveRegister);
-		twiWaitFlag();
-		if(twiGetStatus() == 0x28){
-			twiWriteByte(data);
-			twiWaitFlag();
-			if(twiGetStatus() == 0x28){
-				return 1;
-			}
+		status = twiWaitFlag() ? twiGetStatus() : 0xF8;
+		if(isRead && (status == 0x28)){
+			status = twiInit(slaveAddress, 1);
 		}
 	}
+	
+	return status;
+}
+
+//Write only one byte
+//Return 1 if OK, 0 if error (see twiLastError)
+uint8_t twiWriteOneByte(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t data){
+	
+	uint8_t status = twiSelectRegister(slaveAddress, slaveRegister, 0);
+	
+	if(status == 0x28){
+		twiWriteByte(data);
+		status = twiWaitFlag() ? twiGetStatus() : 0xF8;
+	}
 
-	return 0;
+	return twiEnd(status, 0x28);
 }
 
 //Read only one byte
-//Return the read value
+//Return the read value, 0 if error (see twiLastError)
 uint8_t twiReadOneByte(uint8_t slaveAddress, uint8_t slaveRegister){
 
 	uint8_t value = 0;
+	uint8_t status = twiSelectRegister(slaveAddress, slaveRegister, 1);
 	
-	if(twiInit(slaveAddress, 0) == 0x18){
-		twiWriteByte(slaveRegister);
-		twiWaitFlag();
-		if(twiGetStatus() == 0x28){
-			if(twiInit(slaveAddress, 1) == 0x40){
-				TWCR = 1<<TWINT | 1<<TWEN;
-				while(!(TWCR & (1<<TWINT)));
-				if((TWSR & 0xF8) == 0x58){
-					value = TWDR;
-					TWCR = 1<<TWINT | 1<<TWEN;
-				}
-			}
+	if(status == 0x40){
+		TWCR = 1<<TWINT | 1<<TWEN; //NACK, only one byte
+		status = twiWaitFlag() ? twiGetStatus() : 0xF8;
+		if(status == 0x58){
+			value = TWDR;
 		}
 	}
 	
+	twiEnd(status, 0x58);
+	
 	return value;
 	
 }
 
 //Read multiple bytes
-//Return 1 if OK, 0 if error.
+//Return 1 if OK, 0 if error (see twiLastError).
 uint8_t twiReadMultipleBytes(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t result[], uint8_t nbBytes){
 	
-	uint8_t i;
-	
-	if(twiInit(slaveAddress, 0) == 0x18){
-		twiWriteByte((slaveRegister | (1<<7)));
-		twiWaitFlag();
-		if(twiGetStatus() == 0x28){
-			if(twiInit(slaveAddress, 1) == 0x40){
-				for(i = 0 ; i < nbBytes ; i++){
-					TWCR = 1<<TWINT | 1<<TWEN | 1<<TWEA;
-					while(!(TWCR & (1<<TWINT)));
-					if((TWSR & 0xF8) == 0x50){
-						result[i] = TWDR;
-					}
-					else{
-						break;
-					}
-				}
-				if(i == nbBytes){
-					return 1;
-				}
+	uint8_t status = twiSelectRegister(slaveAddress, slaveRegister | (1<<7), 1);
+	
+	if(status == 0x40){
+		for(uint8_t i = 0 ; i < nbBytes ; i++){
+			if(i < (nbBytes - 1)){
+				TWCR = 1<<TWINT | 1<<TWEN | 1<<TWEA; //ACK, more bytes to come
+			}
+			else{
+				TWCR = 1<<TWINT | 1<<TWEN; //NACK the last byte
+			}
+			status = twiWaitFlag() ? twiGetStatus() : 0xF8;
+			if((status == 0x50) || (status == 0x58)){
+				result[i] = TWDR;
+			}
+			else{
+				break;
 			}
 		}
 	}
 	
-	return 0;
+	return twiEnd(status, 0x58);
 	
-}
\ No newline at end of file
+}
+
+//*************************************
+//INTERRUPT DRIVEN (NON BLOCKING) TRANSACTIONS
+//*************************************
+
+//Circular queue of transactions. The running one is twiQueueList[twiQueueHead].
+TwiTransaction *volatile twiQueueList[TWI_QUEUE_SIZE];
+volatile uint8_t twiQueueHead = 0;
+volatile uint8_t twiQueueCount = 0;
+
+//Running transaction progress
+volatile uint8_t twiByteIndex = 0;
+volatile uint8_t twiReadPhase = 0; //1 once the register is sent and the REPEATED START to read requested
+
+//Set by TWI_vect and by each START, cleared by twiWatchdog()
+volatile uint8_t twiProgress = 0;
+
+//1 while twiFinish() runs the callback: a transaction queued by the callback is started by twiFinish()
+volatile uint8_t twiFinishing = 0;
+
+//Send a START for the transaction at the head of the queue.
+//If a STOP is given, it is sent first (STOP followed by START), else
+//it is a REPEATED START when the bus is still ours.
+void twiStartNext(uint8_t withStop){
+	twiByteIndex = 0;
+	twiReadPhase = 0;
+	twiProgress = 1; //A full watchdog period before this transaction can be aborted
+	TWCR = 1<<TWINT | 1<<TWSTA | withStop<<TWSTO | 1<<TWEN | 1<<TWIE;
+}
+
+//Remove the transaction at the head of the queue and call its callback
+TwiTransaction *twiPop(uint8_t status, uint8_t error){
+	TwiTransaction *transaction = twiQueueList[twiQueueHead];
+
+	twiQueueHead = (twiQueueHead + 1) % TWI_QUEUE_SIZE;
+	twiQueueCount--;
+
+	transaction->error = error;
+	transaction->status = status;
+	if(transaction->callback){
+		uint8_t finishing = twiFinishing;
+		twiFinishing = 1;
+		transaction->callback(transaction);
+		twiFinishing = finishing;
+	}
+	
+	return transaction;
+}
+
+//End the running transaction, call its callback and start the next one (or release the bus)
+void twiFinish(uint8_t status, uint8_t error){
+	TwiTransaction *transaction = twiPop(status, error);
+
+	if(twiQueueCount > 0){
+		//Keep the bus only after a complete transaction, a failed one may have left it anywhere
+		twiStartNext(!(transaction->repeatedStart && (status == TWI_DONE)));
+	}
+	else{
+		TWCR = 1<<TWINT | 1<<TWSTO | 1<<TWEN; //STOP, TWI interrupt disabled
+	}
+}
+
+//Queue a transaction.
+//Return 1 if queued, 0 if the queue is full or the transaction is already pending.
+uint8_t twiQueue(TwiTransaction *transaction){
+
+	uint8_t queued = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if((twiQueueCount < TWI_QUEUE_SIZE) && (transaction->status != TWI_PENDING)){
+			transaction->status = TWI_PENDING;
+			twiQueueList[(twiQueueHead + twiQueueCount) % TWI_QUEUE_SIZE] = transaction;
+			twiQueueCount++;
+			if((twiQueueCount == 1) && !twiFinishing){ //Bus was idle, start now
+				twiStartNext(0);
+			}
+			queued = 1;
+		}
+	}
+
+	return queued;
+}
+
+//Return 1 if no transaction is queued or running
+uint8_t twiIsIdle(){
+	return (twiQueueCount == 0);
+}
+
+//End every queued transaction with TWI_ERROR (callbacks called) and free the bus.
+//The bus recovery (about 110us) does not disable the interrupts, the transactions
+//queued meanwhile are started once it is done.
+void twiAbort(uint8_t error){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		TWCR = 1<<TWEN; //TWI interrupt disabled
+		twiFinishing = 1; //Transactions queued by the callbacks are not started, they are aborted too
+		while(twiQueueCount > 0){
+			twiPop(TWI_ERROR, error);
+		}
+	}
+	
+	twiRecover(); //twiFinishing still set : a transaction queued by an interrupt waits for the bus
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		twiFinishing = 0;
+		if(twiQueueCount > 0){
+			twiStartNext(0);
+		}
+	}
+}
+
+//Call it regularly, less often than a transaction lasts.
+//No TWI_vect nor START since the last call while a transaction is queued : the bus is stuck,
+//the queue is aborted with TWI_ERR_TIMEOUT. Return 1 if it was.
+uint8_t twiWatchdog(){
+
+	uint8_t stuck;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		stuck = (twiQueueCount > 0) && !twiProgress;
+		twiProgress = 0;
+	}
+	if(stuck){
+		twiAbort(TWI_ERR_TIMEOUT);
+	}
+	
+	return stuck;
+}
+
+//TWI state machine, one interrupt per bus event (about every 23us at 400kHz)
+ISR(TWI_vect){
+
+	TwiTransaction *transaction = twiQueueList[twiQueueHead];
+	uint8_t status = TWSR & 0xF8;
+
+	twiProgress = 1;
+
+	switch(status){
+		case 0x08: //START
+		case 0x10: //REPEATED START, to read or to chain the next transaction
+			if(twiReadPhase){
+				TWDR = (transaction->slaveAddress << 1) | 1; //SLA+R
+			}
+			else{
+				TWDR = transaction->slaveAddress << 1; //SLA+W, the register is always written first
+			}
+			TWCR = 1<<TWINT | 1<<TWEN | 1<<TWIE;
+			break;
+		case 0x18: //SLA+W sent, ACK received
+			if(transaction->nbBytes > 1){
+				TWDR = transaction->slaveRegister | (1<<7); //Auto increment
+			}
+			else{
+				TWDR = transaction->slaveRegister;
+			}
+			TWCR = 1<<TWINT | 1<<TWEN | 1<<TWIE;
+			break;
+		case 0x28: //Data sent, ACK received
+			if(transaction->isRead){
+				twiReadPhase = 1;
+				TWCR = 1<<TWINT | 1<<TWSTA | 1<<TWEN | 1<<TWIE; //Register sent, REPEATED START to read
+			}
+			else if(twiByteIndex < transaction->nbBytes){
+				TWDR = transaction->data[twiByteIndex++];
+				TWCR = 1<<TWINT | 1<<TWEN | 1<<TWIE;
+			}
+			else{
+				twiFinish(TWI_DONE, TWI_ERR_NONE);
+			}
+			break;
+		case 0x40: //SLA+R sent, ACK received. ACK every byte but the last one.
+			if(transaction->nbBytes > 1){
+				TWCR = 1<<TWINT | 1<<TWEA | 1<<TWEN | 1<<TWIE;
+			}
+			else{
+				TWCR = 1<<TWINT | 1<<TWEN | 1<<TWIE;
+			}
+			break;
+		case 0x50: //Data received, ACK sent
+			transaction->data[twiByteIndex++] = TWDR;
+			if(twiByteIndex < (transaction->nbBytes - 1)){
+				TWCR = 1<<TWINT | 1<<TWEA | 1<<TWEN | 1<<TWIE;
+			}
+			else{
+				TWCR = 1<<TWINT | 1<<TWEN | 1<<TWIE; //NACK the last byte
+			}
+			break;
+		case 0x58: //Last data received, NACK sent
+			transaction->data[twiByteIndex++] = TWDR;
+			twiFinish(TWI_DONE, TWI_ERR_NONE);
+			break;
+		default: //0x20, 0x30, 0x48 : NACK / 0x38 : arbitration lost / 0x00 : bus error
+			twiFinish(TWI_ERROR, twiStatusError(status));
+			break;
+	}
+}
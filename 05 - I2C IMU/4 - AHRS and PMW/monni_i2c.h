@@ -7,10 +7,26 @@
 #ifndef MONNI_I2C
 #define MONNI_I2C
 
-#include <avr/io.h>
+#include "monni_hal.h"
 
-//Wait for the interrupt flag to be set
-void twiWaitFlag();
+//Error codes (twiLastError and TwiTransaction.error)
+#define TWI_ERR_NONE 0
+#define TWI_ERR_TIMEOUT 1 //No answer of the TWI hardware in time : bus stuck, recovered
+#define TWI_ERR_NACK_ADDRESS 2 //No slave at this address (or busy)
+#define TWI_ERR_NACK_DATA 3 //Written byte refused
+#define TWI_ERR_ARBITRATION 4 //Another master (or noise) on the bus
+#define TWI_ERR_BUS 5 //Illegal START/STOP or unexpected status code
+
+//Longest wait of the blocking functions for one bus event, in loops (about 6 cycles each):
+//about 4ms at 8MHz, a byte takes 23us at 400kHz
+#define TWI_TIMEOUT_LOOPS 5000
+
+//Last error of a blocking function (TWI_ERR_NONE when it succeeded)
+extern uint8_t twiLastError;
+
+//Wait for the interrupt flag to be set, TWI_TIMEOUT_LOOPS at most
+//Return 1 if set, 0 on timeout
+uint8_t twiWaitFlag();
 
 //Get status code
 uint8_t twiGetStatus();
@@ -19,25 +35,79 @@ uint8_t twiGetStatus();
 void twiWriteByte(uint8_t byte);
 
 
+//Free a slave holding SDA low : up to 9 SCL pulses, then a STOP.
+//Called after a timeout, TWI is enabled again with the same bit rate.
+void twiRecover();
+
+
 //*************************************
 //USEFULL FUNCTIONS BELLOW
+//Each one ends with a STOP and lasts TWI_TIMEOUT_LOOPS per bus event at most.
 //*************************************
 
 //Initialize a TWI communication sending a Start and SLA+R/W
-//Return the status code
+//Return the status code, 0xF8 if the bus did not answer in time
 uint8_t twiInit(uint8_t slaveAddress, uint8_t isRead);
 
 //Write only one byte
-//Return 1 if OK, 0 if error
+//Return 1 if OK, 0 if error (see twiLastError)
 uint8_t twiWriteOneByte(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t data);
 
 //Read only one byte
-//Return the read value
+//Return the read value, 0 if error (see twiLastError)
 uint8_t twiReadOneByte(uint8_t slaveAddress, uint8_t slaveRegister);
 
 //Read multiple bytes
-//Return 1 if OK, 0 if error
+//Return 1 if OK, 0 if error (see twiLastError)
 uint8_t twiReadMultipleBytes(uint8_t slaveAddress, uint8_t slaveRegister, uint8_t result[], uint8_t nbBytes);
 
 
+//*************************************
+//INTERRUPT DRIVEN (NON BLOCKING) TRANSACTIONS
+//Transactions are queued and run one after the other by TWI_vect.
+//A transaction with repeatedStart set keeps the bus: the next queued one starts with a
+//REPEATED START instead of a STOP and a START (even on another slave).
+//Do not use the blocking functions above while the queue is not empty.
+//*************************************
+
+//Maximum number of queued transactions
+#define TWI_QUEUE_SIZE 8
+
+//Transaction status
+#define TWI_IDLE 0 //Never queued or result already used
+#define TWI_PENDING 1 //Queued or running
+#define TWI_DONE 2 //Completed, data[] is valid
+#define TWI_ERROR 3 //NACK, arbitration lost or bus error
+
+typedef struct TwiTransaction TwiTransaction;
+
+struct TwiTransaction {
+	uint8_t slaveAddress; //7 bits address
+	uint8_t slaveRegister; //First register, auto-incremented if nbBytes > 1
+	uint8_t *data; //Bytes to write or buffer for read bytes
+	uint8_t nbBytes;
+	uint8_t isRead;
+	uint8_t repeatedStart; //1 : no STOP before the next queued transaction
+	volatile uint8_t status;
+	uint8_t error; //TWI_ERR_xxx, when status is TWI_ERROR
+	void (*callback)(TwiTransaction *transaction); //Called from TWI_vect when done (or error), can be 0. Can queue a transaction.
+};
+
+//Queue a transaction. TWI must be enabled and interrupts too.
+//Return 1 if queued, 0 if the queue is full or the transaction is already pending.
+uint8_t twiQueue(TwiTransaction *transaction);
+
+//Return 1 if no transaction is queued or running
+uint8_t twiIsIdle();
+
+//End every queued transaction with TWI_ERROR and this error (callbacks called), then free the bus.
+//The bus recovery (about 110us) does not disable the interrupts.
+void twiAbort(uint8_t error);
+
+//Call it regularly, less often than a transaction lasts.
+//No TWI_vect nor START since the last call while a transaction is queued : the bus is stuck,
+//the queue is aborted with TWI_ERR_TIMEOUT. Return 1 if it was.
+uint8_t twiWatchdog();
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "monni_clock.h"
+#include "monni_scheduler.h"
+
+uint32_t schedulerDt = 0;
+
+SchedulerTask *schedulerTasks;
+uint8_t schedulerNbTasks = 0;
+
+//Tasks releases from now. clockInit() must have been called.
+void schedulerInit(SchedulerTask tasks[], uint8_t nbTasks){
+
+	uint32_t now = clockMicros();
+
+	schedulerTasks = tasks;
+	schedulerNbTasks = nbTasks;
+
+	for(uint8_t i = 0 ; i < nbTasks ; i++){
+		tasks[i].nextRun = now + tasks[i].phase;
+		tasks[i].lastRun = tasks[i].nextRun;
+		tasks[i].deadlineMisses = 0;
+	}
+}
+
+//Run the first due task, if any.
+//Return 1 if a task was run, 0 if every task is waiting.
+uint8_t schedulerRun(){
+
+	uint32_t now = clockMicros();
+
+	for(uint8_t i = 0 ; i < schedulerNbTasks ; i++){
+		SchedulerTask *task = &schedulerTasks[i];
+
+		//Signed difference, right across the clock wrap
+		if((int32_t)(now - task->nextRun) >= 0){
+
+			//Time since the last run, 0 the first time (lastRun is still the first release,
+			//after a run nextRun is always later than lastRun)
+			if(task->lastRun == task->nextRun){
+				schedulerDt = 0;
+			}
+			else{
+				schedulerDt = now - task->lastRun;
+			}
+			task->lastRun = now;
+
+			//Releases missed while another task was running
+			task->nextRun += task->period;
+			while((int32_t)(now - task->nextRun) >= 0){
+				task->nextRun += task->period;
+				task->deadlineMisses++;
+			}
+
+			task->run();
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
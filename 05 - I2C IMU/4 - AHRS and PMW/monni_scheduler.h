@@ -0,0 +1,39 @@
+//*****************************************
+//Damien Monni - www.damien-monni.fr
+//
+//Cooperative fixed rate scheduler, on the microseconds clock (monni_clock.h).
+//Each task runs every "period" us, the first time "phase" us after
+//schedulerInit() (different phases keep tasks of the same rate apart).
+//schedulerRun() runs at most one task per call, the first due task of the
+//list, so put the fastest tasks first.
+//*****************************************
+
+#ifndef MONNI_SCHEDULER
+#define MONNI_SCHEDULER
+
+#include "monni_hal.h"
+
+//Period in us of a task running at hz
+#define SCHEDULER_HZ(hz) (1000000UL / (hz))
+
+typedef struct {
+	void (*run)(void);
+	uint32_t period; //Microseconds between two runs
+	uint32_t phase; //Microseconds before the first run
+	uint32_t nextRun; //Time of the next release
+	uint32_t lastRun; //Time of the last run, first release until the first run
+	uint16_t deadlineMisses; //Releases skipped because the task could not run before the next one
+} SchedulerTask;
+
+//Microseconds since the last run of the running task (0 on its first run).
+//Valid only inside a task.
+extern uint32_t schedulerDt;
+
+//Tasks releases from now. clockInit() must have been called.
+void schedulerInit(SchedulerTask tasks[], uint8_t nbTasks);
+
+//Run the first due task, if any.
+//Return 1 if a task was run, 0 if every task is waiting.
+uint8_t schedulerRun();
+
+#endif